@@ -16,7 +16,7 @@ export class Esp32ConnectionError extends Error {
 
 const SAMPLES_SIZE = 1024 / 16;
 const ENCODED_SAMPLES_SIZE = SAMPLES_SIZE * 4;
-const ENCODED_SAMPLES_PACKAGE_SIZE = 8 + 4 + 4 + ENCODED_SAMPLES_SIZE;
+const ENCODED_SAMPLES_PACKAGE_SIZE = 8 + 4 + 4 + 4 + ENCODED_SAMPLES_SIZE;
 
 export class Esp32Service {
     private socket?: WebSocket
@@ -90,21 +90,24 @@ export class Esp32Service {
         let time = data.getBigUint64(offset, true);
         let voltageScaleFactor = data.getFloat32(offset+8, true);
         let currentScaleFactor = data.getFloat32(offset+12, true);
+        let quality = data.getUint32(offset+16, true);
 
+        // Voltages block followed by currents block
         let samples = []
-        offset += (8 + 4 + 4);
+        offset += (8 + 4 + 4 + 4);
+        const currentOffset = offset + SAMPLES_SIZE * 2;
         for ( var i=0; i<SAMPLES_SIZE; ++i ) {
             samples.push({
-                voltage: data.getInt16(offset, true),
-                current: data.getInt16(offset+2, true)
+                voltage: data.getInt16(offset + i*2, true),
+                current: data.getInt16(currentOffset + i*2, true)
             });
-            offset += 4;
         }
         
         return {
             time: Number(time),
             voltageScaleFactor,
             currentScaleFactor,
+            quality,
             samples
         }
     }
@@ -4,9 +4,16 @@ export interface Sample {
     current: number;
 }
 
+// Quality flags of a package. 0 when all the samples are valid
+export const QUALITY_CLIPPED = 0x01;            // Some input overflowed the ADC limits
+export const QUALITY_RANGE_CHANGED = 0x02;      // First samples taken with a new range
+export const QUALITY_SETTLING = 0x04;           // Some samples held while a range settles
+export const QUALITY_UNKNOWN_CHANNEL = 0x08;    // ADC readings of a channel not sampled
+
 export interface SamplesPackage {
     time: number;
     voltageScaleFactor: number;
     currentScaleFactor: number;
+    quality: number;
     samples: Sample[];
 }
\ No newline at end of file
@@ -0,0 +1,156 @@
+#ifndef HISTORY_FLASHLOG_H
+#define HISTORY_FLASHLOG_H
+
+#include "meter/calculatedmeter.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_partition.h"
+#include <stdint.h>
+#include <array>
+
+namespace history {
+
+// Measures of one second. Voltage, current and power are half floats (util/half.h)
+struct Record {
+    uint16_t voltage;           // V rms
+    uint16_t current;           // A rms
+    uint16_t activePower;       // W
+    uint16_t frequency;         // As CalculatedMeasures::signalFrequency
+    uint16_t flags;             // MeasuresBlock quality flags, as CalculatedMeasures::quality
+
+    static Record from( const meter::CalculatedMeasures& measures );
+};
+
+
+// Append-only circular log of per second records in the "history" flash partition.
+// Each 4 KB sector has a header (sequence, boot, energy counters) followed by batches
+// of records, each one with its CRC. Records are queued without waiting and written
+// in whole batches by a low priority task, so flash writes and erases don't delay
+// the caller. A batch is written every BatchRecords seconds: records not written yet
+// are lost on a power cut. Each boot starts a new sector. Each batch has the uptime of
+// its first record, the next ones are a second apart.
+// Flash erases and writes disable the cache of both cores, so the writer task being on
+// core 0 doesn't keep them from stalling the acquisition task on core 1. The timer ISR
+// of adc::direct is registered with ESP_INTR_FLAG_IRAM and keeps sampling meanwhile into
+// its DRAM buffers, dropping the oldest queued one when they are all full and counting
+// it in adc::Stats::dropped. Its queue has adc::direct::QueuedBuffers buffers (about
+// 93 ms), to hold a sector erase, done every RecordsPerSector seconds (typically 45 ms,
+// up to 400 ms), and a batch write, every BatchRecords seconds (about 1 ms). The
+// duration of every operation is measured, and the ones longer than the queue of the
+// ADC driver are counted as overruns.
+class FlashLog {
+public:
+    static const size_t SectorSize = 4096;
+    static const size_t HeaderSize = 64;
+    static const size_t BatchRecords = 49;
+    static const size_t BatchSize = (12 + BatchRecords * sizeof(Record) + 3) / 4 * 4;    // With padding
+    static const size_t BatchesPerSector = (SectorSize - HeaderSize) / BatchSize;
+    static const size_t RecordsPerSector = BatchesPerSector * BatchRecords;
+
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t sequence;              // Increases with every sector written
+        uint32_t boot;                  // Boots since the log was created
+        uint32_t uptime;                // s since boot of the first record
+        double activeEnergy;            // Wh since the log was created, at the first record
+        double apparentEnergy;          // VAh
+        uint32_t crc;
+    };
+
+    struct Batch {
+        uint32_t crc;                   // Of the uptime and the records
+        uint16_t size;
+        uint16_t reserved;
+        uint32_t uptime;                // s since boot of the first record
+        std::array<Record, BatchRecords> records;
+    };
+
+public:
+    FlashLog();
+
+    // Finds the last sector written and starts the writer task. Returns false if
+    // there isn't history partition
+    bool init();
+
+    // Doesn't wait. Returns false if the record has been discarded
+    bool add( const meter::CalculatedMeasures& measures );
+
+    uint32_t boot() const {
+        return m_boot;
+    }
+
+    // Records discarded because the writer didn't keep up
+    uint32_t dropped() const {
+        return m_dropped;
+    }
+
+    // Longest flash erase or write (us)
+    uint32_t maxFlashStall() const {
+        return m_maxFlashStall;
+    }
+
+    // Flash operations longer than the buffers queued by the ADC driver, that have dropped samples
+    uint32_t flashOverruns() const {
+        return m_flashOverruns;
+    }
+
+    // Energy counters since the log was created
+    double activeEnergy() const;
+    double apparentEnergy() const;
+
+    // Readout
+    const esp_partition_t* partition() const {
+        return m_partition;
+    }
+
+    size_t sectors() const {
+        return m_sectors;
+    }
+
+    // Sector being written, or to be opened with the next record. Until then it still
+    // has the oldest records of the log
+    size_t currentSector() const {
+        return m_sector;
+    }
+
+    bool readHeader( size_t sector, SectorHeader& header ) const;
+    bool readBatch( size_t sector, size_t batch, Batch& out ) const;
+
+private:
+    struct Entry {
+        Record record;
+        uint32_t uptime;
+        double activeEnergy;            // Since boot
+        double apparentEnergy;
+    };
+
+    static void writerTask( void* arg );
+    void write( const Entry& entry );
+    void openSector( const Entry& entry );
+    void scan();
+    void measureFlashStall( int64_t start );
+
+private:
+    const esp_partition_t* m_partition;
+    size_t m_sectors;
+    QueueHandle_t m_queue;
+    uint32_t m_dropped;
+    uint32_t m_maxFlashStall;
+    uint32_t m_flashOverruns;
+
+    // Writer task
+    uint32_t m_sequence;
+    uint32_t m_boot;
+    size_t m_sector;
+    size_t m_batchIndex;
+    Batch m_batch;
+    double m_activeEnergyOffset;        // At boot
+    double m_apparentEnergyOffset;
+    double m_lastActiveEnergy;          // Since boot, of the last record queued
+    double m_lastApparentEnergy;
+    mutable portMUX_TYPE m_energyLock;  // Of the last energy counters, read by other tasks
+};
+
+}
+
+#endif
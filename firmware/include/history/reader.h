@@ -0,0 +1,51 @@
+#ifndef HISTORY_READER_H
+#define HISTORY_READER_H
+
+#include "history/flashlog.h"
+#include <stdint.h>
+
+namespace history {
+
+// Sequential reader of the flash log records, from the oldest one. It holds one batch
+// in memory, so the log can be exported without loading it. Reading the sector being
+// written can end before its last batch.
+class Reader {
+public:
+    struct Entry {
+        uint32_t sequence;          // Of the sector
+        uint32_t boot;
+        uint32_t uptime;            // s since boot
+        Record record;
+        double activeEnergy;        // Wh since the log was created, before this record
+    };
+
+public:
+    // Reads sectors with a sequence greater or equal to fromSequence
+    Reader( const FlashLog& log, uint32_t fromSequence = 0 );
+
+    // Returns false at the end of the log
+    bool peek( Entry& entry );
+    void advance();
+
+private:
+    size_t oldestSector() const;
+    bool loadBatch();
+    void nextSector();
+
+private:
+    const FlashLog& m_log;
+    uint32_t m_fromSequence;
+    size_t m_sector;
+    size_t m_sectorsVisited;
+    bool m_headerLoaded;
+    FlashLog::SectorHeader m_header;
+    size_t m_batchIndex;
+    bool m_batchLoaded;
+    FlashLog::Batch m_batch;
+    size_t m_position;
+    double m_activeEnergy;
+};
+
+}
+
+#endif
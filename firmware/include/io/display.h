@@ -5,6 +5,7 @@
 #include "meter/calculatedmeter.h"
 #include "util/trace.h"
 #include <Wire.h>
+#include <array>
 
 
 namespace io {
@@ -21,13 +22,50 @@ public:
 
     void update( const meter::CalculatedMeasures& measures );
 
+private:
+    enum Field {
+        FrequencyField,
+        SampleRateField,
+        VoltageField,
+        CurrentField,
+        ActivePowerField,
+        ApparentPowerField,
+        ReactivePowerField,
+        PowerFactorField,
+        FieldsSize
+    };
+
+    enum Alignment {
+        Left,
+        Right,
+        FirstThird
+    };
+
+    // Text in a fixed position. It is only rendered again when it changes
+    struct TextField {
+        const GFXfont* font;
+        int16_t y;
+        Alignment alignment;
+        String text;
+        bool dirty;
+        bool drawn;
+        int16_t x1;                 // Bounds of the text drawn
+        int16_t y1;
+        uint16_t width;
+        uint16_t height;
+    };
+
 private:
     void mainHeader( uint32_t signalFrequency, uint32_t sampleRate );
-    void mainView( const meter::VariableMeasure& voltage, const meter::VariableMeasure& current );
-    void mainView( const meter::PowerMeasure& power );
+    void setText( Field field, const String& text );
+    void render();
+    void drawField( TextField& field );
+    static bool intersects( const TextField& field, const TextField& other );
 
 private:
     SSD1306 m_lcd;
+    std::array<TextField, FieldsSize> m_fields;
+    bool m_indicator;
 };
 
 }
@@ -0,0 +1,88 @@
+#ifndef GLYPHCACHE_H
+#define GLYPHCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gfxfont.h"
+#include <vector>
+
+// Glyphs of a GFX font converted to the SSD1306 layout: one word per column, with the
+// top row of the glyph in the least significant bit. A column is drawn into the pages
+// of the frame buffer it covers with one shift and two or three byte writes.
+// It only depends on the GFX font structures, so it can be tested on the host.
+class GlyphCache {
+public:
+    // Taller glyphs do not fit in a column word once shifted to their row in the page
+    static const uint8_t MaxGlyphHeight = 24;
+
+    struct Glyph {
+        const uint32_t* columns;
+        uint8_t width;
+        uint8_t height;
+        uint8_t xAdvance;
+        int8_t xOffset;
+        int8_t yOffset;
+    };
+
+public:
+    explicit GlyphCache( const GFXfont* font );
+
+    const GFXfont* font() const {
+        return m_font;
+    }
+
+    // Whether all the glyphs of the font were converted
+    bool valid() const {
+        return m_valid;
+    }
+
+    bool contains( uint8_t c ) const {
+        return (c >= m_first) && (c <= m_last);
+    }
+
+    Glyph glyph( uint8_t c ) const;
+
+    // Draws a glyph with its origin at x, y into a frame buffer of width columns by pages
+    // pages, clipped to it, as Adafruit_GFX::drawChar. setBits( uint8_t& data, uint8_t mask )
+    // is called for each byte covered by the glyph
+    template <typename SetBits>
+    static void draw( const Glyph& glyph, uint8_t* buffer, int16_t width, int16_t pages,
+                      int16_t x, int16_t y, SetBits setBits );
+
+private:
+    const GFXfont* m_font;
+    uint8_t m_first;
+    uint8_t m_last;
+    bool m_valid;
+    std::vector<uint32_t> m_columns;
+    std::vector<uint16_t> m_offsets;    // First column of each glyph
+};
+
+
+// Each column of the glyph, shifted to its row in the page, is written a byte per page
+template <typename SetBits>
+void GlyphCache::draw( const Glyph& glyph, uint8_t* buffer, int16_t width, int16_t pages,
+                       int16_t x, int16_t y, SetBits setBits ) {
+    int16_t top = y + glyph.yOffset;
+    if ( (top >= pages * 8) || (top + glyph.height <= 0) ) {
+        return;
+    }
+    uint8_t skippedRows = (top < 0) ? -top : 0;
+    top += skippedRows;
+    const int16_t firstPage = top / 8;
+    const uint8_t shift = top & 7;
+
+    for( uint8_t i = 0; i < glyph.width; ++i ) {
+        int16_t column = x + glyph.xOffset + i;
+        if ( (column < 0) || (column >= width) ) {
+            continue;
+        }
+        uint32_t bits = (glyph.columns[i] >> skippedRows) << shift;
+        uint8_t* data = buffer + firstPage * width + column;
+        for( int16_t page = firstPage; (page < pages) && (bits != 0); ++page, data += width, bits >>= 8 ) {
+            setBits( *data, bits & 0xFF );
+        }
+    }
+}
+
+#endif
@@ -2,6 +2,15 @@
 #define SSD1306_H
 
 #include "Adafruit_GFX.h"
+#include "io/glyphcache.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include <vector>
+
+#ifndef SSD1306_GFX_TEXT
+#define SSD1306_GFX_TEXT 0
+#endif
 
 class SSD1306: public Adafruit_GFX {
 public:
@@ -15,13 +24,49 @@ public:
 
     void init();
     void drawPixel(int16_t x, int16_t y, uint16_t color);
+    void setRotation(uint8_t r);
+
+    // Lines and rectangles are written a byte of each page at a time
+    void drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
+    void drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
+    void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color);
+
+    // Text with a GFX font, without rotation or scaling, is drawn from glyphs
+    // converted to the page layout on the first use of each font. Built with
+    // SSD1306_GFX_TEXT=1 all the text is drawn by Adafruit_GFX, to compare render times
+    size_t write(uint8_t c);
 
     void clearDisplay();
+
+    // Queues the frame to be sent and returns without waiting for the transfer. 
+    // A flush task sends only the columns of each page that changed. If a new frame
+    // is queued while sending, the flush task continues with it.
     void display();
 
 private:
-    uint8_t *m_buffer;
+    static void flushTask( void* arg );
+    void flush();
+    bool findChanges( size_t page, size_t& firstColumn, size_t& lastColumn );
+    void sendPage( size_t page, size_t firstColumn, size_t lastColumn );
+    template <uint8_t Rotation>
+    void drawRotatedPixel( int16_t x, int16_t y, uint16_t color );
+    void fillDisplayRect( int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color );
+    static void setBits( uint8_t& data, uint8_t mask, uint16_t color );
+    const GlyphCache* glyphCache();
+    void drawGlyph( const GlyphCache::Glyph& glyph, int16_t x, int16_t y, uint16_t color );
+
+private:
+    uint8_t *m_buffer;          // Frame being drawn
+    uint8_t *m_frontBuffer;     // Last frame queued
+    uint8_t *m_sentBuffer;      // Content of the display RAM
+    uint8_t *m_pageBuffer;      // Columns of a page being sent
     size_t m_size;
+    bool m_fullRefresh;
+    SemaphoreHandle_t m_frontMutex;
+    TaskHandle_t m_flushTask;
+    void (SSD1306::*m_drawPixel)( int16_t x, int16_t y, uint16_t color );
+    std::vector<GlyphCache> m_glyphCaches;
+    const GlyphCache* m_glyphCache;     // Cache of the current font
 };
 
 #endif
\ No newline at end of file
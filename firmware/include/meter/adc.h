@@ -6,10 +6,21 @@
 
 namespace adc {
 
+// Channels of a scan sequence recorded with raw buffers: ADC1 has 8
+const size_t MaxSequenceSize = 8;
+
 #if 1
 const size_t SampleRate = 44000;        //Min: 6000
+#ifdef CURRENT_SENSITIVE_CHANNEL
+// The sensitive current input makes a sequence of 3 channels. A group has 5 whole
+// sequences, so every channel has the same readings in each group and its values keep
+// their phase. Buffers still have 64 groups
+const size_t SamplesGroupSize = 15;
+const size_t BufferSize = 960;       //in number of samples (not bytes)
+#else
 const size_t SamplesGroupSize = 16;
 const size_t BufferSize = 1024;      //in number of samples (not bytes)
+#endif
 const size_t BufferCount = 2;
 const size_t GroupedSamplesSize = BufferSize / SamplesGroupSize;
 
@@ -23,6 +34,23 @@ typedef std::array<uint16_t, BufferSize> Buffer;
 // Returns time in us when the first value was sampled
 int64_t readData( Buffer& buffer );
 
+// A reference channel can be read once every ReferenceInterval acquisitions of the
+// channels, without being stored in the buffers. Its readings are accumulated until taken.
+const size_t ReferenceInterval = 32;
+
+struct ReferenceReadings {
+    uint32_t sum;
+    uint32_t count;
+};
+
+// Acquisition counters since start()
+struct Stats {
+    uint32_t produced;          // Buffers filled by the ADC
+    uint32_t consumed;          // Buffers returned by readData
+    uint32_t dropped;           // Buffers overwritten before being read
+    uint32_t isrMaxDuration;    // Max time spent in acquisition ISR (us). 0 if there isn't ISR
+};
+
 #else
 
 const size_t SampleRate = 44000;        //Min: 6000
@@ -1,5 +1,5 @@
-#ifndef ADC_DMA_H
-#define ADC_DMA_H
+#ifndef ADC_DIRECT_H
+#define ADC_DIRECT_H
 
 #include "meter/adc.h"
 
@@ -7,13 +7,26 @@ namespace adc {
 
 namespace direct {
 
+// Buffers queued for readData. More than adc::BufferCount, as the timer ISR keeps sampling
+// while a flash erase stalls the reading task (typically 45 ms): 4 buffers are about 93 ms
+const size_t QueuedBuffers = 4;
+
 void start( const nonstd::span<const adc1_channel_t>& channels );
 
 void stop();
 
+// Channel read every ReferenceInterval acquisitions from the next start().
+// ADC1_CHANNEL_MAX to disable it
+void setReferenceChannel( adc1_channel_t channel );
+
+// Returns the readings of the reference channel since the last call
+ReferenceReadings takeReferenceReadings();
+
 // Returns time in us when the first value was sampled
 int64_t readData( Buffer& buffer );
 
+Stats stats();
+
 }
 
 }
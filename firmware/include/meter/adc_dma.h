@@ -7,13 +7,23 @@ namespace adc {
 
 namespace dma {
 
+// Buffers of the DMA ring
+const size_t QueuedBuffers = adc::BufferCount;
+
 void start( const nonstd::span<const adc1_channel_t>& channels );
 
 void stop();
 
+// The reference channel is not supported by the I2S ADC mode: there are never readings
+void setReferenceChannel( adc1_channel_t channel );
+
+ReferenceReadings takeReferenceReadings();
+
 // Returns time in us when the first value was sampled
 int64_t readData( Buffer& buffer );
 
+Stats stats();
+
 }
 
 }
@@ -0,0 +1,102 @@
+#ifndef METER_ADC_MODEL_H
+#define METER_ADC_MODEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+
+// Conversion model of the ADC, fitted from a sweep of the DAC read by the ADC.
+// Platform independent, so it can be tested on the host.
+
+namespace meter {
+
+namespace _ {
+
+// Piecewise linear conversion from ADC values to tenths of mV, fitted by characterizeAdc.
+// Each segment covers AdcSegmentSize ADC values: its voltage at the first value and the
+// increment up to the first value of the next one.
+struct AdcSegment {
+    uint16_t base;
+    int16_t delta;
+};
+
+static const size_t AdcSegmentBits = 6;
+static const size_t AdcSegmentSize = 1 << AdcSegmentBits;
+static const size_t AdcSegments = 4096 / AdcSegmentSize;
+
+inline uint16_t evaluateSegments( const AdcSegment* model, uint16_t value ) {
+    const AdcSegment& segment = model[value >> AdcSegmentBits];
+    int32_t offset = value & (AdcSegmentSize - 1);
+    return segment.base + ((segment.delta * offset + int32_t(AdcSegmentSize>>1)) >> AdcSegmentBits);
+}
+
+}
+
+
+// DAC output and ADC reading of a point of the sweep. DAC values are in 1/16 of a DAC step
+struct SweepPoint {
+    uint16_t dac;
+    uint16_t adc;
+};
+
+static const uint16_t DacSubsteps = 16;
+
+// Finds the DAC value of the ADC reading at each segment boundary, interpolating between
+// the points of the sweep, that are in DAC order. Noise is removed by taking the sweep as
+// non decreasing. Readings out of the sweep are clamped to its ends, where the ADC
+// saturates. knots has AdcSegments+1 values.
+inline void fitDacModel( SweepPoint* points, size_t size, uint16_t* knots ) {
+    for( size_t i=1; i<size; ++i ) {
+        points[i].adc = std::max( points[i].adc, points[i-1].adc );
+    }
+
+    // Last point of the saturated start and first point of the saturated end
+    size_t first = 0;
+    while( (first+1 < size) && (points[first+1].adc == points[first].adc) ) {
+        ++first;
+    }
+    size_t last = size-1;
+    while( (last > first) && (points[last-1].adc == points[last].adc) ) {
+        --last;
+    }
+
+    size_t p = first;
+    for( size_t k=0; k<=_::AdcSegments; ++k ) {
+        uint32_t adc = k * _::AdcSegmentSize;
+        while( (p <= last) && (points[p].adc < adc) ) {
+            ++p;
+        }
+        if ( p == first ) {
+            knots[k] = points[first].dac;
+        }
+        else if ( p > last ) {
+            knots[k] = points[last].dac;
+        }
+        else {
+            const SweepPoint& before = points[p-1];
+            const SweepPoint& after = points[p];
+            uint32_t deltaAdc = after.adc - before.adc;
+            knots[k] = before.dac +
+                    (((after.dac - before.dac) * (adc - before.adc) + (deltaAdc>>1)) / deltaAdc);
+        }
+    }
+}
+
+// Value of the model given by its knots at an ADC reading
+inline uint16_t evaluateKnots( const uint16_t* knots, uint16_t adc ) {
+    size_t k = adc / _::AdcSegmentSize;
+    uint32_t fraction = adc % _::AdcSegmentSize;
+    return knots[k] +
+        ((int32_t(knots[k+1] - knots[k]) * int32_t(fraction) + (_::AdcSegmentSize>>1)) / int32_t(_::AdcSegmentSize));
+}
+
+inline void knotsToSegments( const uint16_t* knots, _::AdcSegment* segments ) {
+    for( size_t k=0; k<_::AdcSegments; ++k ) {
+        segments[k].base = knots[k];
+        segments[k].delta = knots[k+1] - knots[k];
+    }
+}
+
+}
+
+#endif
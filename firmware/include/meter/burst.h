@@ -0,0 +1,74 @@
+#ifndef METER_BURST_H
+#define METER_BURST_H
+
+#include "meter/adc.h"
+#include "util/blockqueue.h"
+#include "util/pack12.h"
+#include <stdint.h>
+#include <array>
+#include <atomic>
+
+namespace meter {
+
+// Bounded burst of raw ADC buffers at full sample rate for offline analysis.
+// Each buffer is packed (12 bits per sample, channel tags removed) in the acquisition
+// task into a preallocated queue that the network task drains. When the network can't
+// keep up, packets are dropped at the queue, never blocking the acquisition. Packets
+// are numbered, so gaps can be detected by the receiver. Each packet has the channels
+// of the whole scan sequence, from its first sample.
+class Burst {
+public:
+    static const size_t MaxBuffers = 430;               // 10 s at 44 kS/s
+    static const size_t PackedBufferSize = pack12::packedSize( adc::BufferSize );
+    static const size_t QueueSize = 8;
+
+    // Sent as is (little endian). Samples of the channels are interleaved in the
+    // order given by the first channelsSize channels
+    struct Packet {
+        uint64_t time;                  // us, first sample of the buffer
+        uint32_t sequence;
+        uint16_t samples;
+        uint8_t channelsSize;           // Channels of the scan sequence
+        uint8_t reserved;
+        uint8_t channels[adc::MaxSequenceSize];    // Channel of each sample of the sequence
+        std::array<uint8_t, PackedBufferSize> data;
+    };
+
+    typedef BlockQueue<Packet, QueueSize> Queue;
+
+public:
+    // sequenceSize: channels of the scan sequence sampled, up to adc::MaxSequenceSize
+    explicit Burst( size_t sequenceSize ): m_sequenceSize(sequenceSize), m_remaining(0), 
+                                           m_sequence(0) {}
+
+    // Returns false if a burst is in progress
+    bool start( size_t buffers );
+    void stop();
+
+    // True while buffers are pending to be recorded
+    bool active() const {
+        return m_remaining.load() > 0;
+    }
+
+    // Acquisition task
+    void record( const adc::Buffer& buffer, uint64_t time );
+
+    // Network task
+    Queue& queue() {
+        return m_queue;
+    }
+
+    uint32_t dropped() const {
+        return m_queue.dropped();
+    }
+
+private:
+    const uint8_t m_sequenceSize;
+    Queue m_queue;
+    std::atomic<uint32_t> m_remaining;
+    uint32_t m_sequence;
+};
+
+}
+
+#endif
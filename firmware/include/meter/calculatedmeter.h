@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <numeric>
 #include <limits>
+#include <cmath>
 
 namespace meter {
 
@@ -54,6 +55,22 @@ public:
         m_squaredSum += other.squaredSum();
     }
 
+    // Converts the accumulated values to units factor times smaller. Peaks out of
+    // int16 in the new units are saturated
+    void rescale( double factor ) {
+        if ( m_min <= m_max ) {
+            m_min = saturate( m_min * factor );
+            m_max = saturate( m_max * factor );
+        }
+        m_sum = std::llround( m_sum * factor );
+        m_squaredSum = std::llround( m_squaredSum * factor * factor );
+    }
+
+private:
+    static int16_t saturate( double value ) {
+        return std::lround( std::max( -32768.0, std::min( 32767.0, value ) ) );
+    }
+
 private:
     int64_t m_sum;
     int64_t m_squaredSum;
@@ -98,6 +115,12 @@ public:
         m_activePowerSum = 0;
     }
 
+    void rescale( double voltageFactor, double currentFactor ) {
+        m_voltage.rescale( voltageFactor );
+        m_current.rescale( currentFactor );
+        m_activePowerSum = std::llround( m_activePowerSum * voltageFactor * currentFactor );
+    }
+
 private:
     VariableAccumulator m_voltage;
     VariableAccumulator m_current;
@@ -227,6 +250,31 @@ private:
 };
 
 
+class EnergyMeasure {
+public:
+    EnergyMeasure(): m_active(0.0), m_apparent(0.0) {}
+
+    // In Wh
+    double active() const {
+        return m_active;
+    }
+
+    // In VAh
+    double apparent() const {
+        return m_apparent;
+    }
+
+    void accumulate( const PowerMeasure& power, uint32_t intervalMs ) {
+        m_active += power.active() * intervalMs / 3600000.0;
+        m_apparent += power.apparent() * intervalMs / 3600000.0;
+    }
+
+private:
+    double m_active;
+    double m_apparent;
+};
+
+
 class CalculatedMeasures {
 public:
     CalculatedMeasures() {}
@@ -234,12 +282,16 @@ public:
                         uint32_t signalFrequency,
                         const VariableMeasure& voltage,
                         const VariableMeasure& current,
-                        const PowerMeasure& power ): 
+                        const PowerMeasure& power,
+                        const EnergyMeasure& energy,
+                        uint8_t quality ): 
             m_sampleRate(sampleRate), 
             m_signalFrequency(signalFrequency),
             m_voltage(voltage), 
             m_current(current),
-            m_power(power) {}
+            m_power(power),
+            m_energy(energy),
+            m_quality(quality) {}
     
     uint32_t sampleRate() const {
         return m_sampleRate;
@@ -262,12 +314,24 @@ public:
         return m_power;
     }
 
+    // Accumulated since boot
+    const EnergyMeasure& energy() const {
+        return m_energy;
+    }
+
+    // MeasuresBlock quality flags of all the values measured. 0 when all of them are valid
+    uint8_t quality() const {
+        return m_quality;
+    }
+
 private:
     uint32_t m_sampleRate;
     uint32_t m_signalFrequency;
     VariableMeasure m_voltage;
     VariableMeasure m_current;
     PowerMeasure m_power;
+    EnergyMeasure m_energy;
+    uint8_t m_quality;
 };
 
 
@@ -283,11 +347,16 @@ public:
     CalculatorBasedMeter();
     ~CalculatorBasedMeter();
 
+    // Values accumulated for the current chunk are converted to the new factors
     void scaleFactors( const std::pair<float, float>& factors );
-    bool process( uint64_t time, const SampleBasedMeter::Measures& samples );
+    bool process( const SampleBasedMeter::Measures& samples );
 
     Measures get();
 
+    // Last calculated measures, without waiting for new ones. 
+    // Returns false if there aren't measures yet.
+    bool last( Measures& measures );
+
 private:
     void reset();    
     void fetch();
@@ -297,6 +366,7 @@ private:
     float m_voltageScaleFactor;
     float m_currentScaleFactor;
     QueueHandle_t m_valueQueue;
+    QueueHandle_t m_lastValueQueue;
     impl::Accumulator m_periodAccumulator;
     impl::Accumulator m_accumulator;
     int16_t m_lastVoltage;
@@ -304,7 +374,9 @@ private:
     size_t m_sampledPeriods;
     SampledPeriodsAccumulator m_sampledPeriodsAccumulator;
     int64_t m_lastTimeFetched;
-    CalculatedMeasures m_currentMeasures;
+    uint32_t m_fetchInterval;
+    EnergyMeasure m_energy;
+    uint8_t m_quality;
 };
 
 }
@@ -0,0 +1,119 @@
+#ifndef METER_CAPTURE_H
+#define METER_CAPTURE_H
+
+#include "meter/adc.h"
+#include "meter/measuresblock.h"
+#include "util/pack12.h"
+#include <stdint.h>
+#include <array>
+#include <atomic>
+
+namespace meter {
+
+// Triggered capture of raw ADC buffers, like an oscilloscope in single shot mode.
+// Once armed, raw buffers are packed (see util/pack12.h) in a preallocated ring before
+// they are grouped. The ring is allocated in external RAM when the board has it.
+// When the trigger condition is found in a block, recording continues until the ring
+// holds the requested pre-trigger buffers, the trigger buffer and the post-trigger ones.
+// record() and check() run in the acquisition task. arm(), trigger() and the readout
+// can be called from other tasks. Arming again discards the previous capture.
+// Each record has the channels of the whole scan sequence, from its first sample.
+class Capture {
+public:
+    static const size_t InternalBuffers = 10;       // 232 ms at 44 kS/s
+    static const size_t ExternalBuffers = 1290;     // 30 s at 44 kS/s. 2 MB
+    static const size_t PackedBufferSize = pack12::packedSize( adc::BufferSize );
+
+    enum Trigger {
+        ManualTrigger,
+        VoltageTrigger,         // |voltage| >= level (V)
+        CurrentTrigger,         // |current| >= level (A)
+        OverflowTrigger,        // Any value out of the ADC input limits
+        TriggersSize
+    };
+
+    enum State {
+        Idle,
+        Armed,
+        Triggered,
+        Completed
+    };
+
+    // Records start at cache lines, so the ring in external RAM is written in whole lines
+    struct alignas(32) Record {
+        uint64_t time;          // us, first sample of the buffer
+        uint8_t channelsSize;   // Channels of the scan sequence
+        uint8_t channels[adc::MaxSequenceSize];     // Channel of each sample of the sequence
+        std::array<uint8_t, PackedBufferSize> data;
+    };
+
+public:
+    // sequenceSize: channels of the scan sequence sampled, up to adc::MaxSequenceSize
+    explicit Capture( size_t sequenceSize );
+    ~Capture();
+
+    // Allocates the ring. Returns false if there isn't memory
+    bool init();
+
+    // Buffers of the ring
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    // Returns false if a capture is in progress or the arguments are invalid
+    bool arm( Trigger trigger, float level, size_t preTriggerBuffers );
+    void trigger();
+    void cancel();
+
+    State state() const {
+        return m_state.load( std::memory_order_acquire );
+    }
+
+    // Acquisition task
+    void record( const adc::Buffer& buffer, uint64_t time );
+    void check( const MeasuresBlock& block, bool overflow );
+
+    // Readout. Only valid when state() is Completed
+    size_t size() const {
+        return m_recorded;
+    }
+
+    // Records in chronological order
+    const Record& operator[]( size_t index ) const {
+        return m_records[(m_first + index) % m_capacity];
+    }
+
+    // Position of the raw sample that fired the trigger from the first one captured.
+    // Its resolution is a group of samples
+    size_t triggerSample() const {
+        return m_triggerSample;
+    }
+
+    static const char* triggerName( Trigger trigger );
+
+private:
+    bool isTriggered( const MeasuresBlock& block, bool overflow );
+    static int findLevel( const MeasuresBlock::Values& values, float scaleFactor, float level );
+
+private:
+    const uint8_t m_sequenceSize;
+    Record* m_records;
+    size_t m_capacity;
+    bool m_external;
+    Record m_staging;           // Internal RAM. Packed here when the ring is external
+    std::atomic<State> m_state;
+    std::atomic<bool> m_manualTrigger;
+    Trigger m_trigger;
+    float m_level;
+    size_t m_preTriggerBuffers;
+    size_t m_postTriggerBuffers;
+    size_t m_next;
+    size_t m_recorded;
+    size_t m_first;
+    size_t m_triggerSample;
+    int m_triggerGroup;
+};
+
+}
+
+#endif
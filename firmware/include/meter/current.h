@@ -13,7 +13,15 @@ namespace current {
 static const adc1_channel_t INPUT_CHANNEL = ADC1_CHANNEL_3;
 static const uint N_RANGES = 3;
 
-typedef SingleSampleBasedMeter<INPUT_CHANNEL, N_RANGES> BaseMeter;
+// Boards with a second amplifier of the shunt voltage define its channel and its gain 
+// relative to the main one (CURRENT_SENSITIVE_CHANNEL and CURRENT_SENSITIVE_GAIN)
+#ifdef CURRENT_SENSITIVE_CHANNEL
+static const adc1_channel_t SENSITIVE_CHANNEL = CURRENT_SENSITIVE_CHANNEL;
+#else
+static const adc1_channel_t SENSITIVE_CHANNEL = ADC1_CHANNEL_MAX;
+#endif
+
+typedef SingleSampleBasedMeter<INPUT_CHANNEL, N_RANGES, SENSITIVE_CHANNEL> BaseMeter;
 
 void setGPIORange( size_t range );
 
@@ -39,7 +47,7 @@ private:
 	static constexpr float AMPLIFIER_GAIN = 1.0 + (AMPLIFIER_R_FB / AMPLIFIER_R_IN);
 	
 public:
-	CurrentMeter(): current::BaseMeter(current::setGPIORange, "current") {
+	CurrentMeter(): current::BaseMeter(current::setGPIORange, "current", autoRangeSettings()) {
 		current::init();
 	}
 
@@ -54,11 +62,21 @@ public:
                                         0.0001078, 
                                         0.0000116, 
                                         scaleFactorForR(R3+R2+R1) };
+#endif
+#ifdef CURRENT_SENSITIVE_GAIN
+        m_sensitive.setGain( CURRENT_SENSITIVE_GAIN );     // Nominal, until calibrated
 #endif
         current::BaseMeter::init( defaultZero, scaleFactors );
 	}
 
 private:
+    // Loads draw current peaks when they switch on: switch to a wider range earlier and
+    // to a narrower one after 3 s with a wide margin
+    static AutoRangeSettings autoRangeSettings() {
+        AutoRangeSettings settings = { 0.8, 0.5, 129 };
+        return settings;
+    }
+
 	static float scaleFactorForR( uint32_t r ) {
 		return 1 / (AMPLIFIER_GAIN * r);
 	}
@@ -0,0 +1,81 @@
+#ifndef METER_MEASURESBLOCK_H
+#define METER_MEASURESBLOCK_H
+
+#include "meter/adc.h"
+#include <stdint.h>
+#include <array>
+#include <utility>
+
+namespace meter {
+
+// Block of grouped measures of one ADC buffer. Values are stored as a structure
+// of arrays (all voltages, then all currents) so each pipeline stage walks through
+// contiguous memory.
+class MeasuresBlock {
+public:
+    static const size_t Size = adc::GroupedSamplesSize;
+    typedef std::array<int16_t, Size> Values;
+
+    // Quality flags of the values. Flags of several blocks are combined with OR
+    static const uint8_t Clipped = 0x01;           // Some input overflowed the ADC limits
+    static const uint8_t RangeChanged = 0x02;      // First values taken with a new range
+    static const uint8_t Settling = 0x04;          // Some values held while a range settles
+    static const uint8_t UnknownChannel = 0x08;    // ADC readings of a channel not sampled
+
+public:
+    MeasuresBlock(): m_time(0), m_scaleFactors(0.0, 0.0), m_quality(0) {}
+
+    // Time in us when the first value was sampled
+    uint64_t time() const {
+        return m_time;
+    }
+
+    void setTime( uint64_t time ) {
+        m_time = time;
+    }
+
+    // Voltage and current scale factors of the ranges used to take the values
+    const std::pair<float, float>& scaleFactors() const {
+        return m_scaleFactors;
+    }
+
+    void setScaleFactors( const std::pair<float, float>& scaleFactors ) {
+        m_scaleFactors = scaleFactors;
+    }
+
+    // Quality flags. 0 when all the values are valid
+    uint8_t quality() const {
+        return m_quality;
+    }
+
+    void setQuality( uint8_t quality ) {
+        m_quality = quality;
+    }
+
+    const Values& voltage() const {
+        return m_voltage;
+    }
+
+    Values& voltage() {
+        return m_voltage;
+    }
+
+    const Values& current() const {
+        return m_current;
+    }
+
+    Values& current() {
+        return m_current;
+    }
+
+private:
+    uint64_t m_time;
+    std::pair<float, float> m_scaleFactors;
+    uint8_t m_quality;
+    Values m_voltage;
+    Values m_current;
+};
+
+}
+
+#endif
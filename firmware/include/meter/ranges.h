@@ -2,6 +2,8 @@
 #define MEASURER_RANGES_H
 
 #include "util/trace.h"
+#include "esp_timer.h"
+#include "nonstd/span.hpp"
 
 #include <array>
 #include <algorithm>
@@ -25,15 +27,23 @@ public:
 		m_zero = zero;
 	}
 
-	void setFactors( float factor, float underflowFactor ) {
+	void setFactor( float factor ) {
 		TRACE( "Factor changed: %f -> %f", m_scaleFactor, factor );
 		m_scaleFactor = factor;
-        setUnderflowFactor( underflowFactor );
 	}
 
-    bool isUnderflow( uint16_t rawValue ) const {
-        int16_t value = rawValue - m_zero;
-        return (m_underflowMax > value) && (m_underflowMin < value);
+    // Fraction of the input limits used by values between min and max, with the zero 
+    // moved by zeroDrift. 1 or more when they overflow
+    float usage( uint16_t min, uint16_t max, int16_t zeroDrift ) const {
+        int32_t zero = m_zero + zeroDrift;
+        float ret = 0;
+        if ( (max > zero) && (HIGHEST_INPUT_VALUE > zero) ) {
+            ret = float(max - zero) / float(HIGHEST_INPUT_VALUE - zero);
+        }
+        if ( (min < zero) && (zero > LOWEST_INPUT_VALUE) ) {
+            ret = std::max( ret, float(zero - min) / float(zero - LOWEST_INPUT_VALUE) );
+        }
+        return ret;
     }
 
 	int16_t applyOffset( uint16_t value ) const {
@@ -44,34 +54,36 @@ public:
         return  (LOWEST_INPUT_VALUE > value) || (HIGHEST_INPUT_VALUE < value);
     }
 
-private:
-    void setUnderflowFactor( float underflowScaleFactor ) {
-        int16_t max = HIGHEST_INPUT_VALUE - m_zero;
-        int16_t min = LOWEST_INPUT_VALUE - m_zero;
-        float p = underflowScaleFactor / m_scaleFactor;
-        m_underflowMax = p * max;
-        m_underflowMin = p * min;
-        TRACE( "Underflow limits: [%d .. %d]", m_underflowMin, m_underflowMax );
-    }
-
 private:
 	float m_scaleFactor;
 	uint16_t m_zero;
-	int16_t m_underflowMax;
-	int16_t m_underflowMin;
 };
 
 
+// Hysteresis of the auto range, as fractions of the input limits used by the peaks of
+// each block (a block spans more than a 50 Hz cycle)
+struct AutoRangeSettings {
+    float upUsage;              // A block above it changes to a wider range, before clipping
+    float downUsage;            // Changes to a narrower range if its peaks would be below it...
+    uint32_t downBlocks;        // ...for these consecutive blocks
+};
+
+
+// Ranges of an input, from the widest to the narrowest
 template<size_t N>
 class Ranges {
 private:
 	typedef std::array<Range, N> Container;
 
-	static const uint OverflowsThreshold = 2;
-	static const uint ResetOverflowsThreshold = 100;
-	static const uint UnderflowsThreshold = 3000;
-
 public:
+    Ranges(): m_active(0), m_previous(0), m_previousScale(1.0), m_switchTime(0), 
+            m_switchPending(false), m_zeroDrift(0), m_best(0), m_marginBlocks(0), 
+            m_autoRange(false), m_overflowed(false) {
+        AutoRangeSettings settings = { 0.9, 0.6, 43 };
+        setAutoRangeSettings( settings );
+        resetPeaks();
+    }
+
     template <typename C>
     void setZeros( const C& zeros ) {
         for( uint i = 0; i < N; ++i ) {
@@ -81,24 +93,22 @@ public:
 
     template <typename C>
     void setScaleFactors( const C& scaleFactors ) {
-        for( uint i = 0; i < N-1; ++i ) {
-            m_ranges[i].setFactors( scaleFactors[i], scaleFactors[i+1] );
+        for( uint i = 0; i < N; ++i ) {
+            m_ranges[i].setFactor( scaleFactors[i] );
         }
-        m_ranges[N-1].setFactors( scaleFactors[N-1], 0.0 );
+    }
+
+    void setAutoRangeSettings( const AutoRangeSettings& settings ) {
+        m_autoRangeSettings = settings;
     }
 
     size_t active() const {
 		return m_active;
 	}
 
+    // Range chosen from the peaks of the last blocks
     size_t best() const {
-		if ( (m_active > 0) && (m_overflows > OverflowsThreshold) ) {
-			return m_active - 1;
-		}
-        if ( m_underflows > UnderflowsThreshold ) {
-            return m_active + 1;
-        }
-		return m_active;
+		return m_best;
 	}
 
     bool autoRange() const {
@@ -113,52 +123,156 @@ public:
         m_autoRange = value;
     }
 
+    int16_t zeroDrift() const {
+        return m_zeroDrift;
+    }
+
+    // Offset added to the zeros of all the ranges, measured since they were calibrated
+    void setZeroDrift( int16_t drift ) {
+        m_zeroDrift = drift;
+    }
+
+	// Ranges are switched while sampling. Until the switch is ended, values read before it
+	// can be converted from the previous range with processPrevious()
 	void setActive( size_t position ) {
+		if ( position != m_active ) {
+			m_previous = m_active;
+			m_previousScale = m_ranges[m_previous].scaleFactor() / m_ranges[position].scaleFactor();
+			m_switchTime = esp_timer_get_time();
+			m_switchPending = true;
+		}
 		m_active = position;
-		m_overflows = 0;
-		m_underflows = 0;
+		m_best = position;
+		m_marginBlocks = 0;
+		resetPeaks();
+	}
+
+	bool switchPending() const {
+		return m_switchPending;
+	}
+
+	// Time in us when the active range was set
+	uint64_t switchTime() const {
+		return m_switchTime;
+	}
+
+	void endSwitch() {
+		m_switchPending = false;
+	}
+
+	// Value read with the previous range, in units of the active one
+	int16_t processPrevious( uint16_t value ) const {
+		float volts = (m_ranges[m_previous].applyOffset(value) - m_zeroDrift) * m_previousScale;
+		return std::max( -32768.0f, std::min( 32767.0f, volts ) );
 	}
 
 	int16_t process( uint16_t value ) {
-		int16_t volts = m_ranges[m_active].applyOffset(value);
+		int16_t volts = m_ranges[m_active].applyOffset(value) - m_zeroDrift;
+        bool overflow = Range::isOverflow( value );
+        m_overflowed |= overflow;
         if ( m_autoRange ) {
-            updateScores( value );
+            m_peakMin = std::min( m_peakMin, value );
+            m_peakMax = std::max( m_peakMax, value );
         }
         return volts;
     }
 
+    // Same as process() for a whole block, in a pass without branches per value. Overflow
+    // and peaks are taken from the extremes of the block
+    void processBlock( nonstd::span<const uint16_t> values, nonstd::span<int16_t> result ) {
+        if ( m_autoRange ) {
+            processBlock<true>( values, result );
+        }
+        else {
+            processBlock<false>( values, result );
+        }
+    }
+
+    // Updates the best range with the peaks of the block processed. A wider range is chosen
+    // as soon as the peaks get near the input limits. A narrower one, when the peaks would
+    // have kept a margin in it for a while
+    void endBlock() {
+        if ( !m_autoRange || (m_peakMin > m_peakMax) ) {
+            resetPeaks();
+            return;
+        }
+        float usage = m_ranges[m_active].usage( m_peakMin, m_peakMax, m_zeroDrift );
+        resetPeaks();
+
+        if ( (m_active > 0) && (usage >= m_autoRangeSettings.upUsage) ) {
+            m_best = m_active - 1;
+            m_marginBlocks = 0;
+            return;
+        }
+        if ( m_active+1 < N ) {
+            float narrowerUsage = usage * 
+                    (m_ranges[m_active].scaleFactor() / m_ranges[m_active+1].scaleFactor());
+            if ( narrowerUsage <= m_autoRangeSettings.downUsage ) {
+                if ( ++m_marginBlocks >= m_autoRangeSettings.downBlocks ) {
+                    m_best = m_active + 1;
+                }
+                return;
+            }
+        }
+        m_marginBlocks = 0;
+    }
+
+    // Returns if any value has overflowed the input limits since the last call
+    bool takeOverflow() {
+        bool ret = m_overflowed;
+        m_overflowed = false;
+        return ret;
+    }
+
 	const Range& operator[](size_t index) const {
 		return m_ranges[index];
 	} 
 
 private:
-    void updateScores( uint16_t volts ) {
-        if ( Range::isOverflow( volts ) ) {
-            ++m_overflows;
-			m_withoutOverflows = 0;
-		}
-		else {
-			if ( (m_overflows > 0) && (++m_withoutOverflows > ResetOverflowsThreshold) ) {
-				m_overflows = 0;
-			}
-		}
+    template <bool AutoRange>
+    void processBlock( nonstd::span<const uint16_t> values, nonstd::span<int16_t> result ) {
+        uint16_t offset = m_ranges[m_active].zero() + m_zeroDrift;
+        uint16_t min = 0xFFFF;
+        uint16_t max = 0;
+        const uint16_t* it = values.data();
+        const uint16_t* end = it + values.size();
+        int16_t* dest = result.data();
+        for( ; it != end; ++it, ++dest ) {
+            uint16_t value = *it;
+            *dest = value - offset;
+            min = std::min( min, value );
+            max = std::max( max, value );
+        }
 
-        if ( m_ranges[m_active].isUnderflow( volts ) ) {
-            ++m_underflows;
+        if ( !values.empty() ) {
+            m_overflowed |= Range::isOverflow( min ) || Range::isOverflow( max );
         }
-        else {
-            m_underflows = 0;
+        if ( AutoRange ) {
+            m_peakMin = std::min( m_peakMin, min );
+            m_peakMax = std::max( m_peakMax, max );
         }
-	}
+    }
+
+    void resetPeaks() {
+        m_peakMin = 0xFFFF;
+        m_peakMax = 0;
+    }
 
 private:
 	Container m_ranges;
 	size_t m_active;
-	uint m_overflows;
-    uint m_underflows;
-	uint m_withoutOverflows;
+	size_t m_previous;
+	float m_previousScale;
+	uint64_t m_switchTime;
+	bool m_switchPending;
+	int16_t m_zeroDrift;
+    size_t m_best;
+    AutoRangeSettings m_autoRangeSettings;
+    uint32_t m_marginBlocks;
+    uint16_t m_peakMin;
+    uint16_t m_peakMax;
     bool m_autoRange;
-	std::array<uint, N> m_scores;
+    bool m_overflowed;
 };
 
 }
@@ -4,41 +4,43 @@
 #include "meter/voltage.h"
 #include "meter/current.h"
 #include "meter/sampler.h"
+#include "meter/measuresblock.h"
+#include "meter/zerotracker.h"
 
 namespace meter {
 
 class SampleBasedMeter {
 public:
     static const size_t MeasuresSize = adc::GroupedSamplesSize;
+    static const adc1_channel_t ZeroChannel = ADC1_CHANNEL_6;
 
-    class Measure {
-    public:
-        Measure(): m_voltage(0), m_current(0) {}
-        Measure( float voltage, float current ): m_voltage(voltage), m_current(current) {}
+    typedef MeasuresBlock Measures;
 
-        int16_t voltage() const {
-            return m_voltage;
-        }
-
-        int16_t current() const {
-            return m_current;
-        }
+private:
+    typedef std::conditional<CurrentMeter::HasSensitiveInput,
+                meter::Sampler<VoltageMeter::AdcChannel, CurrentMeter::AdcChannel, 
+                                CurrentMeter::SensitiveAdcChannel>,
+                meter::Sampler<VoltageMeter::AdcChannel, CurrentMeter::AdcChannel> >::type Sampler;
 
-    private:
-        int16_t m_voltage;
-        int16_t m_current;
-    };
+public:
+    typedef Sampler::RawObserver RawObserver;
 
-    typedef std::array<Measure, MeasuresSize> Measures; 
-
-private:
-    typedef meter::Sampler<VoltageMeter::AdcChannel, 
-						    CurrentMeter::AdcChannel> Sampler;
+    // Channels of the scan sequence of the raw buffers
+    static const size_t SequenceSize = Sampler::ChannelsSize;
+    static_assert( SequenceSize <= adc::MaxSequenceSize, "Scan sequence too long" );
+    static_assert( adc::SamplesGroupSize % SequenceSize == 0, 
+                   "Groups with different readings of each channel" );
 
 public:
+    SampleBasedMeter(): m_overflow(false) {
+        m_sampler.setReferenceChannel( ZeroChannel );
+    }
+
     void init( uint16_t defaultZero ) {
+        loadAdcCharacterization();
         m_voltageMeasurer.init(defaultZero);
         m_currentMeasurer.init(defaultZero);
+        m_zeroTracker.init();
     }
 
     VoltageMeter& voltageMeter() {
@@ -61,11 +63,24 @@ public:
         m_sampler.stop();
     }
 
-    uint64_t read( Measures& result ) {
+    void setRawObserver( RawObserver observer ) {
+        m_sampler.setRawObserver( observer );
+    }
+
+    void read( Measures& result ) {
         Sampler::Samples samples;
-        uint64_t time = m_sampler.read( samples );
+        m_sampler.read( samples );
         process( samples, result );
-        return time;
+    }
+
+    // Returns if any value of the last block read has overflowed the ADC input limits
+    bool overflow() const {
+        return m_overflow;
+    }
+
+    // Drift of the zero reference since the zeros were calibrated, in tenths of mV
+    int16_t zeroDrift() const {
+        return m_zeroTracker.drift();
     }
 
     void calibrateZeros() {
@@ -73,48 +88,58 @@ public:
             characterizeAdc( DAC_CHANNEL_1, ADC1_CHANNEL_4, ADC1_CHANNEL_6, ADC1_CHANNEL_7 );
             m_voltageMeasurer.calibrateZeros();
             m_currentMeasurer.calibrateZeros();
+            m_zeroTracker.calibrate( readZeroReference() );
         });
     }
 
     void calibrateFactors() {
         m_sampler.pauseWhileAction( [&]() {
 		    m_voltageMeasurer.calibrateFactors();
+            m_currentMeasurer.calibrateSensitiveGain();
         });
     }
 
+    // Ranges are changed without pausing the sampler. Only the values read while the
+    // inputs settle are lost
     bool autoRange() {
-        VoltageMeter::AutoRangeAction voltageAutoRangeAction = m_voltageMeasurer.autoRangeAction();
-        CurrentMeter::AutoRangeAction currentAutoRangeAction = m_currentMeasurer.autoRangeAction();
-
-        if ( !voltageAutoRangeAction && !currentAutoRangeAction ) {
-            return false;
-        }
-        m_sampler.pauseWhileAction( [&]() {
-            if ( voltageAutoRangeAction ) {
-                voltageAutoRangeAction();
-            }
-            if ( currentAutoRangeAction ) {
-                currentAutoRangeAction();
-            }
-        } ); 
-        return true;
+        bool voltageChanged = m_voltageMeasurer.applyAutoRange();
+        bool currentChanged = m_currentMeasurer.applyAutoRange();
+        return voltageChanged || currentChanged;
     }
 
 private:
+    uint16_t readZeroReference() {
+        meter::Sampler<ZeroChannel> zeroSampler;
+        zeroSampler.start();
+        uint16_t ret = zeroSampler.readAndAverage<ZeroChannel>(10);
+        zeroSampler.stop();
+        return ret;
+    }
+
     void process( const Sampler::Samples& samples, Measures& result ) {
-        typedef Sampler::Samples::value_type InputSample;
-        std::transform( samples.begin(), samples.end(), result.begin(), 
-            [&](const InputSample& inputSample) {
-                int16_t voltage = m_voltageMeasurer.process( inputSample );
-                int16_t current = m_currentMeasurer.process( inputSample );
-                return Measure( voltage, current );
-            });
+        if ( samples.reference() != Sampler::Samples::UNDEFINED_VALUE ) {
+            m_zeroTracker.add( samples.reference() );
+            int16_t drift = m_zeroTracker.drift();
+            m_voltageMeasurer.setZeroDrift( drift );
+            m_currentMeasurer.setZeroDrift( drift );
+        }
+        result.setTime( samples.time() );
+        result.setScaleFactors( scaleFactors() );
+        uint8_t quality = m_voltageMeasurer.process( samples, result.voltage() ) |
+                          m_currentMeasurer.process( samples, result.current() );
+        if ( samples.unknownChannel() ) {
+            quality |= Measures::UnknownChannel;
+        }
+        result.setQuality( quality );
+        m_overflow = (quality & Measures::Clipped) != 0;
     }
 
 private:
     Sampler m_sampler;
     VoltageMeter m_voltageMeasurer;
     CurrentMeter m_currentMeasurer;
+    ZeroTracker m_zeroTracker;
+    bool m_overflow;
 };
 
 }
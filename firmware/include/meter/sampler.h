@@ -11,7 +11,9 @@
 #define ADC_IMPL direct
 #endif
 
+#include "meter/adcmodel.h"
 #include "util/trace.h"
+#include "util/tracering.h"
 #include "driver/adc.h"
 #include "driver/dac.h"
 #include "freertos/semphr.h"
@@ -60,7 +62,15 @@ struct ChannelsTraits {
 
 uint16_t rawToMilliVolts( uint16_t );
 
-uint16_t rawToTenthsOfMilliVolt( uint16_t );
+extern bool adcModelInitialized;
+extern AdcSegment adcModel[AdcSegments];
+
+inline uint16_t rawToTenthsOfMilliVolt( uint16_t value ) {
+    if ( !adcModelInitialized ) {
+        return rawToMilliVolts(value)*10;
+    }
+    return evaluateSegments( adcModel, value );
+}
 
 }
 
@@ -69,6 +79,10 @@ void setAdcVref( uint16_t value );
 void characterizeAdc( dac_channel_t dac, adc1_channel_t adcChannel, 
                     adc1_channel_t adcHighRef, adc1_channel_t adcLowRef );
 
+// Loads the ADC conversion model saved by the last characterization. Returns false if
+// there is none or it is not valid, and the esp-idf calibration is used until characterizeAdc
+bool loadAdcCharacterization();
+
 
 template <adc1_channel_t... Channels>
 class Sampler {
@@ -76,29 +90,55 @@ private:
 	typedef _::ChannelsTraits<Channels...> ChannelsTraits;
 
 public:
-	class Sample {
+	typedef std::array<uint16_t, adc::GroupedSamplesSize> Values;
+
+    static const size_t ChannelsSize = ChannelsTraits::size;
+
+	// Grouped values of one ADC buffer. Values of each channel are stored contiguously.
+	class Samples {
     public:
         static const uint16_t UNDEFINED_VALUE = 0xFFFF;
+		typedef Sampler::Values Values;
 
 	public:
-		Sample() {}
+		Samples(): m_time(0), m_reference(UNDEFINED_VALUE), m_unknownChannel(false) {}
+
+		// Time in us when the first value was sampled
+		uint64_t time() const {
+			return m_time;
+		}
+
+		// Average of the reference channel readings taken with the buffer, in tenths of mV.
+		// UNDEFINED_VALUE if there were none
+		uint16_t reference() const {
+			return m_reference;
+		}
 
-		Sample( const std::array<uint16_t, ChannelsTraits::size>& variables ):
-			m_variables(variables){}
+		// Returns if the buffer had readings of channels not sampled. Values of groups
+		// without readings of a channel are UNDEFINED_VALUE
+		bool unknownChannel() const {
+			return m_unknownChannel;
+		}
 
 		template <adc1_channel_t Channel>
-		uint16_t get() const {
-			return m_variables[ChannelsTraits::template ChannelPosition<Channel>::value];
+		const Values& get() const {
+			return m_values[ChannelsTraits::template ChannelPosition<Channel>::value];
 		}
 
 	private:
-		std::array<uint16_t, ChannelsTraits::size> m_variables;
+		friend class Sampler;
+
+		uint64_t m_time;
+		uint16_t m_reference;
+		bool m_unknownChannel;
+		std::array<Values, ChannelsTraits::size> m_values;
 	};
 
-	typedef std::array<Sample, adc::GroupedSamplesSize> Samples;
+    // Receives each raw ADC buffer before grouping, with the time of its first sample
+    typedef std::function<void(const adc::Buffer&, uint64_t)> RawObserver;
 
 public:
-	Sampler(): m_channels({ Channels... }) {
+	Sampler(): m_channels({ Channels... }), m_referenceChannel(ADC1_CHANNEL_MAX) {
         m_accessSemaphore = xSemaphoreCreateBinary();
     }
 
@@ -107,37 +147,51 @@ public:
     }
 
 	void start() {
+		adc::ADC_IMPL::setReferenceChannel( m_referenceChannel );
 		adc::ADC_IMPL::start( nonstd::span<const adc1_channel_t>( m_channels ) );
+        TRACE_EVENT( SamplerStarted );
         xSemaphoreGive( m_accessSemaphore );
 	}
 
 	void stop() {
         xSemaphoreTake( m_accessSemaphore, portMAX_DELAY );
 		adc::ADC_IMPL::stop();
+        TRACE_EVENT( SamplerStopped );
 	}
 
+    void setRawObserver( RawObserver observer ) {
+        m_rawObserver = observer;
+    }
+
+    // Channel read between the sampled ones, from the next start(). Its average is
+    // given with the samples of each buffer
+    void setReferenceChannel( adc1_channel_t channel ) {
+        m_referenceChannel = channel;
+    }
+
     void pauseWhileAction( std::function<void()> action ) {
         stop();
         action();
         start();
     }
 
-	uint64_t read( Samples& samples ) {
+	void read( Samples& samples ) {
         xSemaphoreTake( m_accessSemaphore, portMAX_DELAY );
 
 		adc::Buffer buffer;
-		uint64_t firstSampleTime = adc::ADC_IMPL::readData( buffer );
+		samples.m_time = adc::ADC_IMPL::readData( buffer );
+		adc::ReferenceReadings reference = adc::ADC_IMPL::takeReferenceReadings();
 
         xSemaphoreGive( m_accessSemaphore );
 
-        adc::Buffer::const_iterator it = buffer.begin();
-		size_t nSamples = 0;
-		while( it < buffer.end() ) {
-			samples[nSamples] = process( nonstd::span<const uint16_t>( it, adc::SamplesGroupSize ) );
-            it += adc::SamplesGroupSize;
-			++nSamples;
-		}		
-		return firstSampleTime;
+		samples.m_reference = (reference.count == 0) ?
+				Samples::UNDEFINED_VALUE :
+				_::rawToTenthsOfMilliVolt( (reference.sum + reference.count/2) / reference.count );
+
+        if ( m_rawObserver ) {
+            m_rawObserver( buffer, samples.m_time );
+        }
+		process( buffer, samples );
 	}
 
 	template <adc1_channel_t Channel>
@@ -149,10 +203,8 @@ public:
 			read( samples );
 
 			totalRead += adc::GroupedSamplesSize;
-			totalSum += std::accumulate( samples.begin(), samples.end(), 0, 
-					[] (size_t sum, const Sample& sample) {
-						return sum + sample.template get<Channel>();
-					});
+			const Values& values = samples.template get<Channel>();
+			totalSum += std::accumulate( values.begin(), values.end(), 0 );
 		}
 		return totalSum / totalRead;
 	}
@@ -168,7 +220,7 @@ private:
 		}
 
 		uint16_t average() const {
-			return (m_count==0) ? Sample::UNDEFINED_VALUE : (m_sum / m_count);
+			return (m_count==0) ? Samples::UNDEFINED_VALUE : (m_sum / m_count);
 		}
 
 	private:
@@ -177,34 +229,35 @@ private:
 	};
 
 
-	template <typename C>
-	Sample process( const C& values ) {
-		std::array<Measure, ChannelsTraits::size> measures;
-		std::for_each( values.begin(), values.end(), [&](uint16_t sample) {
-			uint16_t channel = sample >> 12;
-			uint16_t value = sample & 0xFFF;
-            size_t pos = findChannelPosition(static_cast<adc1_channel_t>(channel));
-            if ( pos < measures.size() ) {
-                uint16_t voltage = _::rawToTenthsOfMilliVolt(value);
-                measures[pos].add( voltage );
-            }
-		});
-
-		std::array<uint16_t, ChannelsTraits::size> variables;
-		std::transform( measures.cbegin(), measures.cend(), variables.begin(), 
-				[](const Measure& measure) {
-					uint16_t average = measure.average();
-                  //  return _::rawToMilliVolts(average);
-                    return average;
-				});
-		return Sample(variables);
+	void process( const adc::Buffer& buffer, Samples& samples ) {
+		samples.m_unknownChannel = false;
+		adc::Buffer::const_iterator it = buffer.begin();
+		for( size_t n = 0; n < adc::GroupedSamplesSize; ++n ) {
+			std::array<Measure, ChannelsTraits::size> measures;
+			adc::Buffer::const_iterator groupEnd = it + adc::SamplesGroupSize;
+			for( ; it != groupEnd; ++it ) {
+				uint16_t channel = *it >> 12;
+				uint16_t value = *it & 0xFFF;
+				size_t pos = findChannelPosition(static_cast<adc1_channel_t>(channel));
+				if ( pos < measures.size() ) {
+					measures[pos].add( _::rawToTenthsOfMilliVolt(value) );
+				}
+				else {
+					samples.m_unknownChannel = true;
+				}
+			}
+
+			for( size_t pos = 0; pos < ChannelsTraits::size; ++pos ) {
+				samples.m_values[pos][n] = measures[pos].average();
+			}
+		}
 	}
 
 	size_t findChannelPosition(adc1_channel_t channel) {
 		typename ChannelsTraits::Array::const_iterator it = 
 						std::find( m_channels.begin(), m_channels.end(), channel );
 		if ( it == m_channels.end() ) {
-			TRACE( "Data found for unknown channel: %d", channel );
+			TRACE_EVENT( UnknownChannel, channel );
           //  abort();
 		}
 		return std::distance( m_channels.begin(), it );
@@ -212,7 +265,9 @@ private:
 
 private:
 	const typename ChannelsTraits::Array m_channels;
+	adc1_channel_t m_referenceChannel;
     SemaphoreHandle_t m_accessSemaphore;
+    RawObserver m_rawObserver;
 };
 
 }
@@ -0,0 +1,88 @@
+#ifndef METER_SENSITIVE_INPUT_H
+#define METER_SENSITIVE_INPUT_H
+
+#include "meter/ranges.h"
+#include "nonstd/span.hpp"
+
+#include <algorithm>
+
+
+namespace meter {
+
+
+// Second input of a meter, amplified by a fixed gain after the range selected for the main
+// one and sampled in the same scan sequence. Each value of the main input is replaced by
+// the sensitive one while it doesn't clip, so small signals get the resolution of a
+// narrower range without switching to it.
+// Merged values are the ones in units of the active range multiplied by outputGain(): the
+// highest gain, up to the sensitive one, that keeps the main input limits in int16. The
+// ADC step is about 2.7 tenths of mV, so a step of the sensitive input is at least one
+// output unit for sensitive gains up to 9. With higher gains (10 in the sensitive_current
+// boards) it is slightly less, and merged values are rounded to the nearest unit.
+// The gain is nominal until it is calibrated against the main input.
+class SensitiveInput {
+public:
+    SensitiveInput(): m_gain(1.0), m_outputGain(1.0), m_zero(0) {}
+
+    float gain() const {
+        return m_gain;
+    }
+
+    // Gain of the sensitive input relative to the main one
+    void setGain( float gain ) {
+        TRACE( "Sensitive gain changed: %f -> %f", m_gain, gain );
+        m_gain = gain;
+        m_outputGain = std::min( gain, 32767.0f / Range::HIGHEST_INPUT_VALUE );
+    }
+
+    float outputGain() const {
+        return m_outputGain;
+    }
+
+    uint16_t zero() const {
+        return m_zero;
+    }
+
+    void setZero( uint16_t zero ) {
+        TRACE( "Sensitive zero changed: %u -> %u", m_zero, zero );
+        m_zero = zero;
+    }
+
+    // Converts values of the main input, in units of the active range, to output units
+    void scale( nonstd::span<int16_t> values ) const {
+        for( int16_t* it = values.data(); it != values.data() + values.size(); ++it ) {
+            *it = saturate( *it * m_outputGain );
+        }
+    }
+
+    // Merges the sensitive values read with the main ones converted in result
+    void merge( nonstd::span<const uint16_t> values, int16_t zeroDrift,
+                nonstd::span<int16_t> result ) const {
+        float sensitiveScale = m_outputGain / m_gain;
+        uint16_t offset = m_zero + zeroDrift;
+        const uint16_t* it = values.data();
+        const uint16_t* end = it + values.size();
+        int16_t* dest = result.data();
+        for( ; it != end; ++it, ++dest ) {
+            float merged = Range::isOverflow( *it ) ?
+                            *dest * m_outputGain :
+                            int16_t(*it - offset) * sensitiveScale;
+            *dest = saturate( merged );
+        }
+    }
+
+private:
+    static int16_t saturate( float value ) {
+        float clamped = std::max( -32768.0f, std::min( 32767.0f, value ) );
+        return clamped + ((clamped < 0.0f) ? -0.5f : 0.5f);
+    }
+
+private:
+    float m_gain;
+    float m_outputGain;
+    uint16_t m_zero;
+};
+
+}
+
+#endif
@@ -2,8 +2,11 @@
 #define SINGLE_SAMPLED_METER_H
 
 #include "meter/ranges.h"
+#include "meter/sensitiveinput.h"
 #include "meter/sampler.h"
+#include "meter/measuresblock.h"
 #include "util/trace.h"
+#include "util/tracering.h"
 
 #include "driver/adc.h"
 #include "nvs_flash.h"
@@ -13,6 +16,7 @@
 #include <cstddef>
 #include <functional>
 #include <array>
+#include <type_traits>
 
 #if 1
 #include <string>
@@ -22,32 +26,45 @@
 namespace meter {
 
 
-template <adc1_channel_t Channel, size_t N_RANGES>
+// SensitiveChannel, if any, is sampled with Channel and merged with it as a SensitiveInput
+template <adc1_channel_t Channel, size_t N_RANGES, 
+          adc1_channel_t SensitiveChannel = ADC1_CHANNEL_MAX>
 class SingleSampleBasedMeter {
 private:
-    typedef SingleSampleBasedMeter<Channel, N_RANGES> ThisType;
 	typedef meter::Ranges<N_RANGES> Ranges;
 	typedef Sampler<Channel> CalibrationSampler;
     struct CalibrationData {
         std::array<uint16_t, N_RANGES> zeros;
     };
+    typedef std::integral_constant<bool, SensitiveChannel != ADC1_CHANNEL_MAX> HasSensitive;
+    typedef Sampler<Channel, (HasSensitive::value ? SensitiveChannel : Channel)> SensitiveSampler;
+
+    // Sensitive gain calibration: buffers averaged and minimum rms of the main input,
+    // in tenths of mV, for a ratio with enough resolution
+    static const size_t SensitiveGainBuffers = 20;
+    static const uint16_t MinSensitiveGainRms = 30;
 	
 protected:
 	typedef std::function<void(size_t)> GPIORangeSetter;
 
-public:
-    typedef std::function<void()> AutoRangeAction;
-	
 public:
     static const size_t RangesSize = N_RANGES;
     static const adc1_channel_t AdcChannel = Channel;
+    static const adc1_channel_t SensitiveAdcChannel = SensitiveChannel;
+    static const bool HasSensitiveInput = HasSensitive::value;
 	static const size_t AutoRange = N_RANGES;
 
+    // Values aren't used from the range switch until the input settles
+    static const uint32_t RangeSettleTime = 200;        // In us
+
 public:
-	SingleSampleBasedMeter( GPIORangeSetter gpioRangeSetter, const char* calibrationStore ): 
-                m_gpioRangeSetter(gpioRangeSetter), m_calibrationStoreName(calibrationStore) {
+	SingleSampleBasedMeter( GPIORangeSetter gpioRangeSetter, const char* calibrationStore,
+                            const AutoRangeSettings& autoRangeSettings ): 
+                m_gpioRangeSetter(gpioRangeSetter), m_calibrationStoreName(calibrationStore),
+                m_lastValue(0), m_switchReported(true) {
         changeRange(0);
         m_ranges.setAutoRange(true);
+        m_ranges.setAutoRangeSettings(autoRangeSettings);
     }
 
     void init( uint16_t defaultZero, const std::array<float, N_RANGES>& scaleFactors ) {
@@ -58,12 +75,29 @@ public:
 
         m_ranges.setZeros( calibrationData.zeros );
         m_ranges.setScaleFactors(scaleFactors);
+        initSensitive( defaultZero, HasSensitive() );
 	} 
 
-    template <typename Sample>
-	int16_t process( const Sample& sample ) {
-        uint16_t value = sample.template get<Channel>();
-		return m_ranges.process( value );
+    // Returns the MeasuresBlock quality flags of the values
+    template <typename Samples, typename Values>
+	uint8_t process( const Samples& samples, Values& result ) {
+        const typename Samples::Values& values = samples.template get<Channel>();
+        uint8_t quality = 0;
+        size_t first = 0;
+        if ( m_ranges.switchPending() ) {
+            first = processSwitch( samples.time(), values, result, quality );
+        }
+        size_t size = values.size() - first;
+        m_ranges.processBlock( nonstd::span<const uint16_t>( values.data() + first, size ),
+                               nonstd::span<int16_t>( result.data() + first, size ) );
+        m_lastValue = values.back();
+        m_ranges.endBlock();
+        mergeSensitive( samples, result, first, HasSensitive() );
+
+        if ( m_ranges.takeOverflow() ) {
+            quality |= MeasuresBlock::Clipped;
+        }
+        return quality;
 	}
 
 	void calibrateZeros() {
@@ -71,10 +105,30 @@ public:
 		sampleAllRanges( zeros );
 		m_ranges.setZeros( zeros );
         saveZerosCalibration( zeros );
+        calibrateSensitiveZero( HasSensitive() );
 	}
 
+    // Measures the gain of the sensitive input relative to the main one. There must be
+    // a signal that doesn't clip the sensitive input
+    void calibrateSensitiveGain() {
+        calibrateSensitiveGain( HasSensitive() );
+    }
+
+    // Scale factor of the values given by process()
     float scaleFactor() const {
-        return m_ranges.scaleFactor();
+        return m_ranges.scaleFactor() / m_sensitive.outputGain();
+    }
+
+    size_t activeRange() const {
+        return m_ranges.active();
+    }
+
+    void setZeroDrift( int16_t drift ) {
+        m_ranges.setZeroDrift( drift );
+    }
+
+    bool autoRange() const {
+        return m_ranges.autoRange();
     }
 
 	void setRange( size_t newRange ) {
@@ -84,22 +138,26 @@ public:
         }
 	}
 
-    AutoRangeAction autoRangeAction() {
+    // Changes to the best range while sampling. Returns if it has changed
+    bool applyAutoRange() {
         if ( !m_ranges.autoRange() ) {
-            return AutoRangeAction();
+            return false;
         }
 
         size_t bestRange = m_ranges.best();
-        return (bestRange == m_ranges.active()) ? 
-                AutoRangeAction() :
-                std::bind( &ThisType::changeRange, this, bestRange );
+        if ( bestRange == m_ranges.active() ) {
+            return false;
+        }
+        changeRange( bestRange );
+        return true;
     }
 
 protected:
     void changeRange( size_t rangeIndx ) {
-        m_ranges.setActive(rangeIndx);
+        TRACE_EVENT( RangeChanged, Channel, m_ranges.active(), rangeIndx );
 		m_gpioRangeSetter(rangeIndx);
-		TRACE("%s range changed to: %d", m_calibrationStoreName, rangeIndx);
+        m_ranges.setActive(rangeIndx);
+        m_switchReported = false;
     }
 
 	void sampleAllRanges( std::array<uint16_t, N_RANGES>& out ) {
@@ -118,6 +176,163 @@ protected:
 	}
 
 private:
+    // Number of grouped values of a block sampled before time
+    static size_t valuesBefore( uint64_t blockTime, uint64_t time, bool partial ) {
+        if ( time <= blockTime ) {
+            return 0;
+        }
+        static const uint64_t Period = 1000000ULL * adc::SamplesGroupSize;     // In us/SampleRate
+        uint64_t elapsed = (time - blockTime) * adc::SampleRate;
+        size_t values = partial ? (elapsed + Period - 1) / Period : elapsed / Period;
+        return std::min( values, adc::GroupedSamplesSize );
+    }
+
+    // Values of the block read before the switch are converted from the previous range,
+    // and the last of them is held while the input settles. Returns the first value read
+    // with the active range, once settled. The block is flagged as RangeChanged the first 
+    // time it has values after the switch, and as Settling while it has held values
+    template <typename Values, typename Result>
+    size_t processSwitch( uint64_t blockTime, const Values& values, Result& result, 
+                          uint8_t& quality ) {
+        size_t previous = valuesBefore( blockTime, m_ranges.switchTime(), false );
+        size_t settled = valuesBefore( blockTime, m_ranges.switchTime() + RangeSettleTime, true );
+
+        for( size_t i = 0; i < previous; ++i ) {
+            result[i] = m_ranges.processPrevious( values[i] );
+            if ( Range::isOverflow( values[i] ) ) {
+                quality |= MeasuresBlock::Clipped;
+            }
+        }
+        if ( (previous < values.size()) && !m_switchReported ) {
+            quality |= MeasuresBlock::RangeChanged;
+            m_switchReported = true;
+        }
+        if ( settled > previous ) {
+            quality |= MeasuresBlock::Settling;
+        }
+        int16_t held = m_ranges.processPrevious( (previous > 0) ? values[previous-1] : m_lastValue );
+        std::fill( result.begin() + previous, result.begin() + settled, held );
+
+        if ( settled < values.size() ) {
+            m_ranges.endSwitch();
+        }
+        return settled;
+    }
+
+    void initSensitive( uint16_t, std::false_type ) {}
+
+    // The nominal gain is kept until it's calibrated
+    void initSensitive( uint16_t defaultZero, std::true_type ) {
+        uint16_t zero = 0;
+        float gain = 0.0;
+        nvs_handle handle;
+        TRACE_ESP_ERROR_CHECK(nvs_open("wattmeter", NVS_READONLY, &handle));
+        size_t size = sizeof(zero);
+        if ( nvs_get_blob(handle, sensitiveStoreName().c_str(), &zero, &size) != ESP_OK ) {
+            zero = defaultZero;
+        }
+        size = sizeof(gain);
+        if ( nvs_get_blob(handle, sensitiveGainStoreName().c_str(), &gain, &size) != ESP_OK ) {
+            gain = 0.0;
+        }
+        nvs_close(handle);
+        m_sensitive.setZero( zero );
+        if ( gain > 0.0 ) {
+            m_sensitive.setGain( gain );
+        }
+    }
+
+    template <typename Samples, typename Values>
+    void mergeSensitive( const Samples&, Values&, size_t, std::false_type ) {}
+
+    // Values held or converted from the previous range around a switch are kept. The
+    // sensitive ones were amplified from a range that isn't known for them
+    template <typename Samples, typename Values>
+    void mergeSensitive( const Samples& samples, Values& result, size_t first, std::true_type ) {
+        const typename Samples::Values& values = samples.template get<SensitiveChannel>();
+        size_t size = values.size() - first;
+        m_sensitive.scale( nonstd::span<int16_t>( result.data(), first ) );
+        m_sensitive.merge( nonstd::span<const uint16_t>( values.data() + first, size ),
+                           m_ranges.zeroDrift(),
+                           nonstd::span<int16_t>( result.data() + first, size ) );
+    }
+
+    void calibrateSensitiveZero( std::false_type ) {}
+
+    void calibrateSensitiveZero( std::true_type ) {
+        Sampler<SensitiveChannel> sampler;
+        sampler.start();
+        uint16_t zero = sampler.template readAndAverage<SensitiveChannel>(10);
+        sampler.stop();
+        TRACE("%s sensitive input calibration: %u", m_calibrationStoreName, zero);
+        m_sensitive.setZero( zero );
+
+        nvs_handle handle;
+        TRACE_ESP_ERROR_CHECK(nvs_open("wattmeter", NVS_READWRITE, &handle));
+        TRACE_ESP_ERROR_CHECK(nvs_set_blob(handle, sensitiveStoreName().c_str(), &zero, 
+                                        sizeof(zero) ) );
+	    TRACE_ESP_ERROR_CHECK(nvs_commit(handle));
+        nvs_close(handle);
+    }
+
+    void calibrateSensitiveGain( std::false_type ) {}
+
+    // Least squares ratio of the sensitive values to the main ones, both from their zeros.
+    // Groups where any of them is out of the input limits are skipped
+    void calibrateSensitiveGain( std::true_type ) {
+        const int32_t mainZero = m_ranges[m_ranges.active()].zero() + m_ranges.zeroDrift();
+        const int32_t sensitiveZero = m_sensitive.zero() + m_ranges.zeroDrift();
+        double products = 0.0;
+        double squares = 0.0;
+        size_t count = 0;
+
+        SensitiveSampler sampler;
+        sampler.start();
+        for( size_t n = 0; n < SensitiveGainBuffers; ++n ) {
+            typename SensitiveSampler::Samples samples;
+            sampler.read( samples );
+            const typename SensitiveSampler::Values& main = samples.template get<Channel>();
+            const typename SensitiveSampler::Values& sensitive = 
+                        samples.template get<SensitiveChannel>();
+            for( size_t i = 0; i < main.size(); ++i ) {
+                if ( Range::isOverflow( main[i] ) || Range::isOverflow( sensitive[i] ) ) {
+                    continue;
+                }
+                double mainValue = int32_t(main[i]) - mainZero;
+                products += (int32_t(sensitive[i]) - sensitiveZero) * mainValue;
+                squares += mainValue * mainValue;
+                ++count;
+            }
+        }
+        sampler.stop();
+
+        if ( (count == 0) || 
+             (squares < double(count) * MinSensitiveGainRms * MinSensitiveGainRms) ) {
+            TRACE_ERROR( "%s sensitive gain not calibrated: signal too small or clipped", 
+                        m_calibrationStoreName );
+            return;
+        }
+        float gain = products / squares;
+        TRACE("%s sensitive gain calibration: %f (%u values)", m_calibrationStoreName, gain, count);
+        m_sensitive.setGain( gain );
+
+        nvs_handle handle;
+        TRACE_ESP_ERROR_CHECK(nvs_open("wattmeter", NVS_READWRITE, &handle));
+        TRACE_ESP_ERROR_CHECK(nvs_set_blob(handle, sensitiveGainStoreName().c_str(), &gain, 
+                                        sizeof(gain) ) );
+	    TRACE_ESP_ERROR_CHECK(nvs_commit(handle));
+        nvs_close(handle);
+    }
+
+    std::string sensitiveStoreName() const {
+        return std::string(m_calibrationStoreName) + "Sens";
+    }
+
+    // NVS keys have up to 15 characters
+    std::string sensitiveGainStoreName() const {
+        return std::string(m_calibrationStoreName) + "SensGain";
+    }
+
     CalibrationData loadCalibration() {
         CalibrationData ret;
 
@@ -144,11 +359,14 @@ private:
 
 protected:
 	Ranges m_ranges;
+    SensitiveInput m_sensitive;
 
 private:
 	CalibrationSampler m_calibrationSampler;
 	GPIORangeSetter m_gpioRangeSetter;
     const char* m_calibrationStoreName;
+    uint16_t m_lastValue;           // Last value read of the previous block
+    bool m_switchReported;          // The block with the range switch has been flagged
 };
 
 }
@@ -41,7 +41,7 @@ private:
 #endif
 	
 public:
-	VoltageMeter(): voltage::BaseMeter(voltage::setGPIORange, "voltage") {
+	VoltageMeter(): voltage::BaseMeter(voltage::setGPIORange, "voltage", autoRangeSettings()) {
 		voltage::init();
 	}
 
@@ -75,6 +75,12 @@ public:
 	}
 
 private:
+    // Voltage is steady: switch to a narrower range after 1 s with margin
+    static AutoRangeSettings autoRangeSettings() {
+        AutoRangeSettings settings = { 0.9, 0.6, 43 };
+        return settings;
+    }
+
     static const float scaleFactorForR(uint rl ) {
         return (float(RH+rl)/float(rl)) / 1000.0;
     }
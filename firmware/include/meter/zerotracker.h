@@ -0,0 +1,90 @@
+#ifndef METER_ZEROTRACKER_H
+#define METER_ZEROTRACKER_H
+
+#include "util/trace.h"
+#include "nvs.h"
+#include <stdint.h>
+#include <algorithm>
+
+namespace meter {
+
+// Follows the drift of the zero reference while sampling. The reference channel is read
+// between the sampled channels and its readings are filtered with an exponentially
+// weighted moving average. The drift is the difference between the filtered value and
+// the value read when the zeros were calibrated, in tenths of mV.
+class ZeroTracker {
+public:
+    static const uint8_t FilterShift = 6;           // Weight of each buffer: 1/64 (1.5 s)
+    static const int16_t MaxDrift = 500;            // 50 mV. Larger values are not drift
+
+public:
+    ZeroTracker(): m_reference(0), m_filtered(0), m_hasReference(false), m_started(false) {}
+
+    // Loads the reference of the last calibration. Without it, the first value read is
+    // taken as reference
+    void init() {
+        nvs_handle handle;
+        if ( nvs_open("wattmeter", NVS_READONLY, &handle) != ESP_OK ) {
+            return;
+        }
+        uint32_t reference;
+        if ( nvs_get_u32(handle, "zeroReference", &reference) == ESP_OK ) {
+            m_reference = reference;
+            m_hasReference = true;
+        }
+        nvs_close(handle);
+    }
+
+    // Sets and saves the reference read when the zeros are calibrated. The filter
+    // starts again, as the conversion of readings may have changed
+    void calibrate( uint16_t reference ) {
+        m_reference = reference;
+        m_hasReference = true;
+        m_started = false;
+
+        nvs_handle handle;
+        if ( nvs_open("wattmeter", NVS_READWRITE, &handle) != ESP_OK ) {
+            return;
+        }
+        TRACE_ESP_ERROR_CHECK(nvs_set_u32(handle, "zeroReference", reference));
+        TRACE_ESP_ERROR_CHECK(nvs_commit(handle));
+        nvs_close(handle);
+    }
+
+    void add( uint16_t value ) {
+        int32_t scaled = int32_t(value) << FilterShift;
+        if ( !m_started ) {
+            m_filtered = scaled;
+            m_started = true;
+            if ( !m_hasReference ) {
+                m_reference = value;
+                m_hasReference = true;
+            }
+            return;
+        }
+        m_filtered += (scaled - m_filtered) >> FilterShift;
+    }
+
+    uint16_t reference() const {
+        return m_reference;
+    }
+
+    int16_t drift() const {
+        if ( !m_started ) {
+            return 0;
+        }
+        int32_t filtered = (m_filtered + (1 << (FilterShift-1))) >> FilterShift;
+        int32_t drift = filtered - m_reference;
+        return std::max<int32_t>( -MaxDrift, std::min<int32_t>( MaxDrift, drift ) );
+    }
+
+private:
+    uint16_t m_reference;
+    int32_t m_filtered;         // Scaled by 2^FilterShift
+    bool m_hasReference;
+    bool m_started;
+};
+
+}
+
+#endif
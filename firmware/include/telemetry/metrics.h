@@ -0,0 +1,83 @@
+#ifndef TELEMETRY_METRICS_H
+#define TELEMETRY_METRICS_H
+
+#include "util/textwriter.h"
+#include "util/histogram.h"
+#include <stdint.h>
+#include <functional>
+
+namespace telemetry {
+
+// Writes metrics in Prometheus text exposition format. Labels are given already
+// formatted (e.g. "stage=\"read\"") or NULL.
+class MetricsWriter {
+public:
+    MetricsWriter( TextWriter& writer ): m_writer(writer) {}
+
+    void family( const char* name, const char* type, const char* help ) {
+        m_writer.printf( "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type );
+    }
+
+    void sample( const char* name, const char* labels, double value ) {
+        writeName( name, "", labels );
+        m_writer.printf( " %.6g\n", value );
+    }
+
+    void sample( const char* name, const char* labels, uint32_t value ) {
+        writeName( name, "", labels );
+        m_writer.printf( " %u\n", value );
+    }
+
+    template <size_t N>
+    void histogram( const char* name, const char* labels, const Histogram<N>& histogram ) {
+        uint32_t cumulative = 0;
+        char le[12];
+        for( size_t i = 0; i < N-1; ++i ) {
+            cumulative += histogram[i];
+            // Prometheus bounds are inclusive. Values are integers: the highest one counted
+            snprintf( le, sizeof(le), "%u", Histogram<N>::upperBound(i) - 1 );
+            writeBucket( name, labels, le, cumulative );
+        }
+        writeBucket( name, labels, "+Inf", histogram.count() );
+        writeName( name, "_sum", labels );
+        m_writer.printf( " %llu\n", histogram.sum() );
+        writeName( name, "_count", labels );
+        m_writer.printf( " %u\n", histogram.count() );
+    }
+
+private:
+    void writeName( const char* name, const char* suffix, const char* labels ) {
+        if ( labels == NULL ) {
+            m_writer.printf( "%s%s", name, suffix );
+        }
+        else {
+            m_writer.printf( "%s%s{%s}", name, suffix, labels );
+        }
+    }
+
+    void writeBucket( const char* name, const char* labels, const char* le, uint32_t value ) {
+        if ( labels == NULL ) {
+            m_writer.printf( "%s_bucket{le=\"%s\"} %u\n", name, le, value );
+        }
+        else {
+            m_writer.printf( "%s_bucket{%s,le=\"%s\"} %u\n", name, labels, le, value );
+        }
+    }
+
+private:
+    TextWriter& m_writer;
+};
+
+
+typedef std::function<void(MetricsWriter&)> MetricsSource;
+
+// Sources are rendered, after pipeline metrics, in the order they were added.
+void addMetricsSource( MetricsSource source );
+
+// Renders all metrics into buffer. Returns the length written. If it is greater or
+// equal than size, the output has been truncated.
+size_t renderMetrics( char* buffer, size_t size );
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "meter/adc.h"
+#include "util/histogram.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+namespace telemetry {
+
+// Latencies in us. Last bucket counts latencies of 2^18 us (262 ms) or more
+typedef Histogram<20> LatencyHistogram;
+
+enum Stage {
+    ReadStage,              // From first sample of buffer until it is grouped and scaled
+    CalculationStage,       // From first sample of buffer until calculation has processed it
+    StagesSize
+};
+
+struct QueueStats {
+    size_t size;
+    size_t capacity;
+    uint32_t dropped;
+};
+
+typedef std::function<QueueStats()> QueueProbe;
+
+// Records the time elapsed from the sampling of a buffer until a stage has processed it.
+// Each stage must be recorded from only one task.
+void recordLatency( Stage stage, uint64_t bufferTime );
+
+const LatencyHistogram& latency( Stage stage );
+
+const char* stageName( Stage stage );
+
+adc::Stats adcStats();
+
+void addQueueProbe( const char* name, QueueProbe probe );
+
+template <typename Q>
+void watchQueue( const char* name, const Q& queue ) {
+    addQueueProbe( name, [&queue]() {
+        QueueStats ret;
+        ret.size = queue.size();
+        ret.capacity = Q::Size;
+        ret.dropped = queue.dropped();
+        return ret;
+    });
+}
+
+size_t queuesSize();
+const char* queueName( size_t index );
+QueueStats queueStats( size_t index );
+
+void watchTask( const char* name, TaskHandle_t task );
+
+size_t tasksSize();
+const char* taskName( size_t index );
+uint32_t taskStackHighWaterMark( size_t index );
+
+// Writes all stats as JSON. Returns the length of the whole JSON: when it is size or
+// more, the output has been truncated
+size_t formatJson( char* buffer, size_t size );
+
+// Writes a summary to the serial trace
+void trace();
+
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef BLOCK_QUEUE_H
+#define BLOCK_QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <array>
+#include <atomic>
+
+// Lock-free queue of preallocated blocks for one producer task and one consumer task.
+// The producer fills back() in place and publishes it with push(). It never waits: when
+// the queue is full the block is discarded and push() returns false.
+// The consumer reads front() in place and releases it with pop().
+template <typename T, size_t S>
+class BlockQueue {
+public:
+	static const size_t Size = S;
+	typedef size_t size_type;
+	typedef T value_type;
+
+private:
+	// One extra slot: the one the producer is writing is never visible to the consumer
+	typedef std::array<T, Size+1> Buffer;
+
+public:
+	BlockQueue(): m_head(0), m_tail(0), m_consumer(NULL), m_dropped(0) {
+	}
+
+	bool empty() const {
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+
+	bool full() const {
+		return inc(m_tail.load(std::memory_order_acquire)) == m_head.load(std::memory_order_acquire);
+	}
+
+	size_type size() const {
+		size_t head = m_head.load(std::memory_order_acquire);
+		size_t tail = m_tail.load(std::memory_order_acquire);
+		return (tail >= head) ? (tail - head) : (tail + Size + 1 - head);
+	}
+
+	// Number of blocks discarded because the queue was full
+	uint32_t dropped() const {
+		return m_dropped;
+	}
+
+	// Producer side
+	value_type& back() {
+		return m_buffer[m_tail.load(std::memory_order_relaxed)];
+	}
+
+	bool push() {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t next = inc(tail);
+		if ( next == m_head.load(std::memory_order_acquire) ) {
+			++m_dropped;
+			return false;
+		}
+		m_tail.store(next, std::memory_order_release);
+
+		TaskHandle_t consumer = m_consumer;
+		if ( consumer != NULL ) {
+			xTaskNotifyGive( consumer );
+		}
+		return true;
+	}
+
+	// Consumer side
+	const value_type& front() const {
+		return m_buffer[m_head.load(std::memory_order_relaxed)];
+	}
+
+	void pop() {
+		if ( empty() ) {
+			return;
+		}
+		m_head.store(inc(m_head.load(std::memory_order_relaxed)), std::memory_order_release);
+	}
+
+	// Blocks the calling task (the consumer) until a block is available.
+	// Returns false on timeout.
+	bool wait( TickType_t timeout = portMAX_DELAY ) {
+		m_consumer = xTaskGetCurrentTaskHandle();
+		while( empty() ) {
+			if ( ulTaskNotifyTake( pdTRUE, timeout ) == 0 ) {
+				return !empty();
+			}
+		}
+		return true;
+	}
+
+private:
+	static size_t inc( size_t index ) {
+		return (++index == Size+1) ? 0 : index;
+	}
+
+private:
+	Buffer m_buffer;
+	std::atomic<size_t> m_head;
+	std::atomic<size_t> m_tail;
+	volatile TaskHandle_t m_consumer;
+	uint32_t m_dropped;
+};
+
+
+#endif
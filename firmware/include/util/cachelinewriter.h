@@ -0,0 +1,86 @@
+#ifndef UTIL_CACHE_LINE_WRITER_H_
+#define UTIL_CACHE_LINE_WRITER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+// Writes a stream of bytes to a memory area in whole cache lines. Small writes are
+// gathered in an internal line and copied when it is full, so writing to external
+// RAM doesn't cause a cache line fill and write back for every few bytes. Lines are
+// aligned to the destination addresses: when the destination isn't aligned, only its
+// first and last lines are partial.
+class CacheLineWriter {
+public:
+    static const size_t LineSize = 32;
+
+public:
+    CacheLineWriter( void* destination, size_t capacity ): 
+            m_destination( static_cast<uint8_t*>(destination) ), m_capacity(capacity), 
+            m_written(0), m_lineSize(0) {
+    }
+
+    ~CacheLineWriter() {
+        flush();
+    }
+
+    // Returns the number of bytes accepted, less than size if capacity is exceeded
+    size_t write( const void* data, size_t size ) {
+        const uint8_t* source = static_cast<const uint8_t*>(data);
+        size = std::min( size, m_capacity - this->size() );
+        size_t remaining = size;
+
+        // Completes the pending line, up to the next line of the destination
+        size_t lineEnd = LineSize - (reinterpret_cast<uintptr_t>(m_destination + m_written) % LineSize);
+        if ( (m_lineSize > 0) || (lineEnd < LineSize) ) {
+            size_t length = std::min( remaining, lineEnd - m_lineSize );
+            memcpy( m_line + m_lineSize, source, length );
+            m_lineSize += length;
+            source += length;
+            remaining -= length;
+            if ( m_lineSize < lineEnd ) {
+                return size;
+            }
+            writeLines( m_line, m_lineSize );
+            m_lineSize = 0;
+        }
+
+        // Whole lines are copied at once
+        size_t lines = remaining - (remaining % LineSize);
+        writeLines( source, lines );
+        source += lines;
+        remaining -= lines;
+
+        memcpy( m_line, source, remaining );
+        m_lineSize = remaining;
+        return size;
+    }
+
+    // Writes the last partial line
+    void flush() {
+        memcpy( m_destination + m_written, m_line, m_lineSize );
+        m_written += m_lineSize;
+        m_lineSize = 0;
+    }
+
+    // Bytes written, including those not flushed yet
+    size_t size() const {
+        return m_written + m_lineSize;
+    }
+
+private:
+    void writeLines( const uint8_t* source, size_t size ) {
+        memcpy( m_destination + m_written, source, size );
+        m_written += size;
+    }
+
+private:
+    uint8_t* m_destination;
+    size_t m_capacity;
+    size_t m_written;
+    size_t m_lineSize;
+    uint8_t m_line[LineSize] __attribute__((aligned(4)));
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef UTIL_EXTRAM_H_
+#define UTIL_EXTRAM_H_
+
+#include <stddef.h>
+
+// Allocation of large buffers (captures, history) in external RAM (PSRAM) on boards
+// that have it. Buffers used by the acquisition hot path must stay in internal RAM:
+// external RAM is accessed through the cache and is several times slower.
+
+namespace extram {
+
+// Buffers are aligned to the cache lines of external RAM
+static const size_t Alignment = 32;
+
+bool available();
+
+// Largest block that can be allocated. 0 if there isn't external RAM
+size_t largestFreeBlock();
+
+// Returns NULL if there isn't external RAM or not enough free
+void* allocate( size_t size );
+
+void release( void* buffer );
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef UTIL_HALF_H_
+#define UTIL_HALF_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Conversion between float and IEEE 754 half precision (11 bits of precision, up
+// to 65504), used to store measures in 2 bytes.
+
+namespace half {
+
+inline uint16_t fromFloat( float value ) {
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof(bits) );
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 127 + 15;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if ( exponent <= 0 ) {                  // Subnormal or zero
+        if ( exponent < -10 ) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        return sign | ((mantissa + (1 << (shift - 1))) >> shift);
+    }
+    if ( exponent >= 31 ) {                 // Overflow, infinity or NaN
+        return sign | 0x7C00 | ((((bits >> 23) & 0xFF) == 0xFF) && mantissa ? 0x200 : 0);
+    }
+    // Rounding to nearest can carry into the exponent, giving the right result
+    return sign | ((exponent << 10) + ((mantissa + 0x1000) >> 13));
+}
+
+inline float toFloat( uint16_t value ) {
+    uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    uint32_t exponent = (value >> 10) & 0x1F;
+    uint32_t mantissa = value & 0x3FF;
+    uint32_t bits;
+
+    if ( exponent == 0 ) {
+        if ( mantissa == 0 ) {
+            bits = sign;
+        }
+        else {                              // Subnormal: normalize it
+            exponent = 127 - 15 + 1;
+            while( (mantissa & 0x400) == 0 ) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+    }
+    else if ( exponent == 31 ) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float ret;
+    memcpy( &ret, &bits, sizeof(ret) );
+    return ret;
+}
+
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <array>
+
+// Histogram with logarithmic buckets: bucket 0 counts zeros, bucket i counts values in
+// [2^(i-1), 2^i) and the last bucket counts all values greater than or equal to 2^(N-2).
+// Only one task may add values. Readers from other tasks can get slightly outdated values.
+template <size_t N>
+class Histogram {
+public:
+	static const size_t Size = N;
+
+public:
+	Histogram() {
+		reset();
+	}
+
+	void reset() {
+		m_buckets.fill(0);
+		m_count = 0;
+		m_sum = 0;
+		m_max = 0;
+	}
+
+	void add( uint32_t value ) {
+		++m_buckets[bucket(value)];
+		++m_count;
+		m_sum += value;
+		if ( value > m_max ) {
+			m_max = value;
+		}
+	}
+
+	uint32_t count() const {
+		return m_count;
+	}
+
+	uint64_t sum() const {
+		return m_sum;
+	}
+
+	uint32_t max() const {
+		return m_max;
+	}
+
+	uint32_t operator[]( size_t index ) const {
+		return m_buckets[index];
+	}
+
+	// Upper bound (exclusive) of values counted in a bucket. 0 for the last one (no limit).
+	static uint32_t upperBound( size_t index ) {
+		return (index == Size-1) ? 0 : (1UL << index);
+	}
+
+private:
+	static size_t bucket( uint32_t value ) {
+		size_t index = (value == 0) ? 0 : (32 - __builtin_clz(value));
+		return (index < Size) ? index : Size-1;
+	}
+
+private:
+	std::array<uint32_t, Size> m_buckets;
+	uint32_t m_count;
+	uint64_t m_sum;
+	uint32_t m_max;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef UTIL_PACK12_H_
+#define UTIL_PACK12_H_
+
+#include "nonstd/span.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+
+// Packing of 12-bit samples, two in 3 bytes: low byte of the first, high nibbles of
+// the first (bits 0-3) and of the second (bits 4-7), low byte of the second.
+// Raw ADC codes carry their channel in the 4 high bits. They are discarded when
+// packing: the channel of each sample is implied by the sampling sequence and
+// restored from it when unpacking.
+
+namespace pack12 {
+
+// Bytes needed to pack a number of samples. An odd last sample takes 2 bytes
+constexpr size_t packedSize( size_t samples ) {
+    return samples / 2 * 3 + (samples % 2) * 2;
+}
+
+// Returns the number of bytes written (packedSize(in.size()))
+inline size_t pack( nonstd::span<const uint16_t> in, nonstd::span<uint8_t> out ) {
+    const uint16_t* it = in.data();
+    const uint16_t* pairsEnd = it + (in.size() & ~1);
+    uint8_t* dest = out.data();
+    for( ; it != pairsEnd; it += 2 ) {
+        uint16_t first = it[0];
+        uint16_t second = it[1];
+        dest[0] = first;
+        dest[1] = ((first >> 8) & 0x0F) | ((second >> 4) & 0xF0);
+        dest[2] = second;
+        dest += 3;
+    }
+    if ( in.size() % 2 ) {
+        dest[0] = *it;
+        dest[1] = (*it >> 8) & 0x0F;
+        dest += 2;
+    }
+    return dest - out.data();
+}
+
+// Channels of the first channels.size() samples: the sequence to unpack them with
+inline void sequence( nonstd::span<const uint16_t> in, nonstd::span<uint8_t> channels ) {
+    const size_t size = std::min( channels.size(), in.size() );
+    for( size_t i = 0; i < size; ++i ) {
+        channels[i] = in[i] >> 12;
+    }
+}
+
+// Unpacks out.size() samples, tagging them with the channels of the sequence, that
+// starts again every channels.size() samples
+inline void unpack( nonstd::span<const uint8_t> in, nonstd::span<uint16_t> out, 
+                    nonstd::span<const uint8_t> channels ) {
+    const uint8_t* source = in.data();
+    size_t channel = 0;
+    const size_t channelsSize = channels.size();
+    for( size_t i = 0; i < static_cast<size_t>(out.size()); ++i ) {
+        uint16_t value = (i % 2) ? 
+                    ((source[1] & 0xF0) << 4) | source[2] : 
+                    ((source[1] & 0x0F) << 8) | source[0];
+        if ( i % 2 ) {
+            source += 3;
+        }
+        out[i] = (channels[channel] << 12) | value;
+        if ( ++channel == channelsSize ) {
+            channel = 0;
+        }
+    }
+}
+
+// Number of values whose channel doesn't follow the sequence. Those can't be
+// restored by unpack
+inline size_t sequenceErrors( nonstd::span<const uint16_t> in, nonstd::span<const uint8_t> channels ) {
+    size_t errors = 0;
+    size_t channel = 0;
+    const size_t channelsSize = channels.size();
+    for( size_t i = 0; i < static_cast<size_t>(in.size()); ++i ) {
+        if ( (in[i] >> 12) != channels[channel] ) {
+            ++errors;
+        }
+        if ( ++channel == channelsSize ) {
+            channel = 0;
+        }
+    }
+    return errors;
+}
+
+}
+
+#endif
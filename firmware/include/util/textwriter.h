@@ -0,0 +1,46 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <algorithm>
+
+// Formats text into a caller buffer without allocating memory. Output is truncated
+// when the buffer is full, but length() keeps counting the length it would have had.
+class TextWriter {
+public:
+	TextWriter( char* buffer, size_t size ): m_pos(buffer), m_end(buffer+size), m_length(0) {
+		if ( size > 0 ) {
+			*m_pos = 0;
+		}
+	}
+
+	void printf( const char* format, ... ) __attribute__ ((format (printf, 2, 3))) {
+		va_list args;
+		va_start( args, format );
+		int written = vsnprintf( m_pos, m_end - m_pos, format, args );
+		va_end( args );
+		if ( written < 0 ) {
+			return;
+		}
+		m_length += written;
+		size_t available = (m_end > m_pos) ? (m_end - m_pos - 1) : 0;
+		m_pos += std::min<size_t>( written, available );
+	}
+
+	size_t length() const {
+		return m_length;
+	}
+
+	bool truncated( size_t size ) const {
+		return m_length >= size;
+	}
+
+private:
+	char* m_pos;
+	char* m_end;
+	size_t m_length;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef UTIL_TRACE_EVENTS_H_
+#define UTIL_TRACE_EVENTS_H_
+
+// Events recorded with TRACE_EVENT. Formats are only used when events are written out,
+// with up to 3 unsigned integer arguments.
+#define TRACE_EVENTS(EVENT) \
+    EVENT( AdcBufferDropped,    "ADC buffer %u dropped" )                             \
+    EVENT( AdcBufferRead,       "ADC buffer %u read" )                                \
+    EVENT( UnknownChannel,      "Data found for unknown channel: %u" )                \
+    EVENT( SamplerStarted,      "Sampler started" )                                   \
+    EVENT( SamplerStopped,      "Sampler stopped" )                                   \
+    EVENT( ChunkCalculated,     "Chunk calculated: %u samples, %u periods" )          \
+    EVENT( RangeChanged,        "Range of channel %u changed: %u -> %u" )             \
+    EVENT( CaptureTriggered,    "Capture triggered: trigger %u, sample %u" )          \
+    EVENT( CaptureCompleted,    "Capture completed: %u buffers" )                     \
+    EVENT( BurstStarted,        "Burst started: %u buffers" )                         \
+    EVENT( BurstPacketDropped,  "Burst packet %u dropped" )                           \
+    EVENT( BurstCompleted,      "Burst completed: %u packets, %u dropped in total" )  \
+    EVENT( HistorySectorErased, "History sector %u erased: %u us" )                   \
+    EVENT( HistorySectorOpened, "History sector %u opened: sequence %u" )             \
+    EVENT( HistoryBatchWritten, "History batch written: sector %u, batch %u, %u us" ) \
+    EVENT( DisplayRendered,     "Display rendered: %u us" )
+
+#endif
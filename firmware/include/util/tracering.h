@@ -0,0 +1,61 @@
+#ifndef UTIL_TRACE_RING_H_
+#define UTIL_TRACE_RING_H_
+
+#include "util/traceevents.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary trace of events. Recording an event only stores its id, a timestamp and its
+// arguments in a ring buffer (no formatting, no allocation), so it can be used in
+// acquisition hot paths and ISRs. When the ring is full, oldest events are overwritten.
+// Events are formatted when they are taken out from the ring: by a low priority task
+// that writes them to serial (startEventsTask) or on demand (formatEvents).
+
+namespace trace {
+
+namespace events {
+
+enum Id: uint16_t {
+#define TRACE_EVENT_ID(id, format) id,
+    TRACE_EVENTS(TRACE_EVENT_ID)
+#undef TRACE_EVENT_ID
+    Size
+};
+
+}
+
+struct Event {
+    uint32_t time;          // us, truncated to 32 bits
+    uint16_t id;
+    uint16_t core;
+    uint32_t args[3];
+};
+
+// Can be called from ISRs
+void event( events::Id id, uint32_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0 );
+
+// Takes the oldest event. Returns false if there isn't any
+bool nextEvent( Event& event );
+
+// Returns if there are events not taken yet
+bool pendingEvents();
+
+// Events overwritten before being taken since boot
+uint32_t lostEvents();
+
+// Formats one event as a text line. Returns the length as snprintf does
+int formatEvent( const Event& event, char* buffer, size_t size );
+
+// Takes and formats as many whole events as fit in buffer. Returns the length written
+size_t formatEvents( char* buffer, size_t size );
+
+// Starts a low priority task that writes events to serial. The firmware starts it
+// when built with TRACE_EVENTS_SERIAL, otherwise events are dumped from /trace
+void startEventsTask();
+
+}
+
+#define TRACE_EVENT(id, ...) \
+        ::trace::event( ::trace::events::id, ##__VA_ARGS__ )
+
+#endif
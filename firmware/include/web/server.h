@@ -2,9 +2,13 @@
 #define WEB_WEBSERVER_H
 
 #include "meter/sampledmeter.h"
+#include "meter/capture.h"
+#include "meter/burst.h"
+#include "history/flashlog.h"
 #include "web/defaultwebsocketserver.h"
 #include <stdint.h>
 #include <array>
+#include <atomic>
 #include <deque>
 #include <functional>
 
@@ -17,8 +21,13 @@ public:
     ~Server();
 
     void begin();
-    void send( uint64_t time, const std::pair<float, float>& scaleFactors,
-                const meter::SampleBasedMeter::Measures& samples );
+    void serveCapture( meter::Capture& capture );
+    void serveBurst( meter::Burst& burst );
+    void serveHistory( const history::FlashLog& log );
+
+    // Sends pending burst packets. Returns false if some couldn't be sent yet
+    bool sendBurst();
+    void send( const meter::SampleBasedMeter::Measures& samples );
 
 private:
     Server( const Server& ) = delete;
@@ -29,6 +38,11 @@ private:
     uint8_t* m_sendBufferPos;
     uint8_t* m_sendBufferEnd;    
     websocket::Buffer* m_sendBuffer;
+
+    // Single client receiving the burst. 0 if there isn't any
+    AsyncWebSocket* m_burstSocket;
+    std::atomic<uint32_t> m_burstClient;
+    meter::Burst* m_burst;
 };
 
 }
@@ -0,0 +1,265 @@
+#include "history/flashlog.h"
+#include "meter/sampler.h"
+#include "util/half.h"
+#include "util/trace.h"
+#include "util/tracering.h"
+#include "rom/crc.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include <stddef.h>
+
+
+namespace history {
+
+static const uint32_t Magic = 0x57484C33;           // "WHL3", records with flags
+static const size_t QueueSize = 64;
+static const uint32_t WriterStackSize = 3072;
+static const char* PartitionLabel = "history";
+// Time the ADC driver buffers samples while a flash operation stalls the acquisition task
+static const uint32_t AdcRingTime = 1000000ULL * adc::ADC_IMPL::QueuedBuffers * adc::BufferSize /
+                                    adc::SampleRate;        // us
+
+
+Record Record::from( const meter::CalculatedMeasures& measures ) {
+    Record ret;
+    ret.voltage = half::fromFloat( measures.voltage().rms() );
+    ret.current = half::fromFloat( measures.current().rms() );
+    ret.activePower = half::fromFloat( measures.power().active() );
+    ret.frequency = std::min<uint32_t>( measures.signalFrequency(), 0xFFFF );
+    ret.flags = measures.quality();
+    return ret;
+}
+
+
+static uint32_t crc( const void* data, size_t size ) {
+    return crc32_le( 0, static_cast<const uint8_t*>(data), size );
+}
+
+
+static bool isValid( const FlashLog::SectorHeader& header ) {
+    return (header.magic == Magic) && 
+            (header.crc == crc( &header, offsetof(FlashLog::SectorHeader, crc) ));
+}
+
+
+static_assert( sizeof(FlashLog::Batch) == FlashLog::BatchSize, "Batch with padding" );
+
+static uint32_t crc( const FlashLog::Batch& batch ) {
+    return crc( &batch.uptime, sizeof(batch.uptime) + batch.size * sizeof(Record) );
+}
+
+
+static bool isValid( const FlashLog::Batch& batch ) {
+    return (batch.size <= FlashLog::BatchRecords) && (batch.crc == crc( batch ));
+}
+
+
+FlashLog::FlashLog(): m_partition(NULL), m_sectors(0), m_queue(NULL), m_dropped(0), 
+                        m_maxFlashStall(0), m_flashOverruns(0), m_sequence(0), m_boot(0), m_sector(0), m_batchIndex(0),
+                        m_activeEnergyOffset(0.0), m_apparentEnergyOffset(0.0),
+                        m_lastActiveEnergy(0.0), m_lastApparentEnergy(0.0) {
+    m_batch.size = 0;
+    portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+    m_energyLock = unlocked;
+}
+
+
+bool FlashLog::init() {
+    m_partition = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, 
+                                            PartitionLabel );
+    if ( m_partition == NULL ) {
+        TRACE_ERROR( "History partition not found" );
+        return false;
+    }
+    m_sectors = m_partition->size / SectorSize;
+
+    scan();
+    TRACE( "History: %u sectors, boot %u, next sector %u (%u)", 
+            m_sectors, m_boot, m_sector, m_sequence );
+
+    m_queue = xQueueCreate( QueueSize, sizeof(Entry) );
+    TaskHandle_t task;
+    xTaskCreatePinnedToCore( writerTask, "historyWriter", WriterStackSize, this, 
+                            tskIDLE_PRIORITY + 1, &task, 0 );
+    return true;
+}
+
+
+bool FlashLog::add( const meter::CalculatedMeasures& measures ) {
+    if ( m_queue == NULL ) {
+        return false;
+    }
+
+    Entry entry;
+    entry.record = Record::from( measures );
+    entry.uptime = esp_timer_get_time() / 1000000;
+    entry.activeEnergy = measures.energy().active();
+    entry.apparentEnergy = measures.energy().apparent();
+    portENTER_CRITICAL( &m_energyLock );
+    m_lastActiveEnergy = entry.activeEnergy;
+    m_lastApparentEnergy = entry.apparentEnergy;
+    portEXIT_CRITICAL( &m_energyLock );
+
+    if ( xQueueSend( m_queue, &entry, 0 ) != pdTRUE ) {
+        ++m_dropped;
+        return false;
+    }
+    return true;
+}
+
+
+double FlashLog::activeEnergy() const {
+    portENTER_CRITICAL( &m_energyLock );
+    double last = m_lastActiveEnergy;
+    portEXIT_CRITICAL( &m_energyLock );
+    return m_activeEnergyOffset + last;
+}
+
+
+double FlashLog::apparentEnergy() const {
+    portENTER_CRITICAL( &m_energyLock );
+    double last = m_lastApparentEnergy;
+    portEXIT_CRITICAL( &m_energyLock );
+    return m_apparentEnergyOffset + last;
+}
+
+
+bool FlashLog::readHeader( size_t sector, SectorHeader& header ) const {
+    return (esp_partition_read( m_partition, sector * SectorSize, &header, sizeof(header) ) == ESP_OK) && 
+            isValid( header );
+}
+
+
+bool FlashLog::readBatch( size_t sector, size_t batch, Batch& out ) const {
+    size_t offset = sector * SectorSize + HeaderSize + batch * BatchSize;
+    return (esp_partition_read( m_partition, offset, &out, sizeof(out) ) == ESP_OK) && 
+            isValid( out );
+}
+
+
+// Finds the sector with the highest sequence. The energy counters at boot are the ones
+// of its header plus the energy of its records
+void FlashLog::scan() {
+    SectorHeader last;
+    bool found = false;
+    size_t lastSector = 0;
+    for( size_t sector = 0; sector < m_sectors; ++sector ) {
+        SectorHeader header;
+        if ( readHeader( sector, header ) && (!found || (header.sequence > last.sequence)) ) {
+            last = header;
+            lastSector = sector;
+            found = true;
+        }
+    }
+
+    if ( !found ) {
+        m_sequence = 0;
+        m_boot = 0;
+        m_sector = 0;
+        return;
+    }
+
+    m_activeEnergyOffset = last.activeEnergy;
+    m_apparentEnergyOffset = last.apparentEnergy;
+    for( size_t i = 0; i < BatchesPerSector; ++i ) {
+        if ( !readBatch( lastSector, i, m_batch ) ) {
+            break;
+        }
+        for( size_t n = 0; n < m_batch.size; ++n ) {
+            const Record& record = m_batch.records[n];
+            float voltage = half::toFloat( record.voltage );
+            float current = half::toFloat( record.current );
+            m_activeEnergyOffset += half::toFloat( record.activePower ) / 3600.0;
+            m_apparentEnergyOffset += voltage * current / 3600.0;
+        }
+    }
+    m_batch.size = 0;
+
+    m_sequence = last.sequence + 1;
+    m_boot = last.boot + 1;
+    m_sector = (lastSector + 1) % m_sectors;
+}
+
+
+void FlashLog::writerTask( void* arg ) {
+    FlashLog* self = static_cast<FlashLog*>(arg);
+    Entry entry;
+    while( true ) {
+        if ( xQueueReceive( self->m_queue, &entry, portMAX_DELAY ) == pdTRUE ) {
+            self->write( entry );
+        }
+    }
+}
+
+
+void FlashLog::write( const Entry& entry ) {
+    if ( (m_batchIndex == 0) && (m_batch.size == 0) ) {
+        openSector( entry );
+    }
+
+    if ( m_batch.size == 0 ) {
+        m_batch.uptime = entry.uptime;
+    }
+    m_batch.records[m_batch.size++] = entry.record;
+    if ( m_batch.size < BatchRecords ) {
+        return;
+    }
+
+    m_batch.crc = crc( m_batch );
+    m_batch.reserved = 0xFFFF;
+    size_t offset = m_sector * SectorSize + HeaderSize + m_batchIndex * BatchSize;
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_partition_write( m_partition, offset, &m_batch, sizeof(m_batch) );
+    measureFlashStall( start );
+    if ( err != ESP_OK ) {
+        TRACE_ERROR( "History batch not written: %d", err );
+    }
+    TRACE_EVENT( HistoryBatchWritten, m_sector, m_batchIndex, esp_timer_get_time() - start );
+
+    m_batch.size = 0;
+    if ( ++m_batchIndex == BatchesPerSector ) {
+        m_batchIndex = 0;
+        m_sector = (m_sector + 1) % m_sectors;
+        ++m_sequence;
+    }
+}
+
+
+// Erases the sector and writes its header. The oldest sector of the log is lost
+void FlashLog::openSector( const Entry& entry ) {
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_partition_erase_range( m_partition, m_sector * SectorSize, SectorSize );
+    measureFlashStall( start );
+    if ( err != ESP_OK ) {
+        TRACE_ERROR( "History sector %u not erased: %d", m_sector, err );
+    }
+    TRACE_EVENT( HistorySectorErased, m_sector, esp_timer_get_time() - start );
+
+    SectorHeader header;
+    memset( &header, 0xFF, sizeof(header) );
+    header.magic = Magic;
+    header.sequence = m_sequence;
+    header.boot = m_boot;
+    header.uptime = entry.uptime;
+    header.activeEnergy = m_activeEnergyOffset + entry.activeEnergy;
+    header.apparentEnergy = m_apparentEnergyOffset + entry.apparentEnergy;
+    header.crc = crc( &header, offsetof(SectorHeader, crc) );
+    start = esp_timer_get_time();
+    err = esp_partition_write( m_partition, m_sector * SectorSize, &header, sizeof(header) );
+    measureFlashStall( start );
+    if ( err != ESP_OK ) {
+        TRACE_ERROR( "History header not written: %d", err );
+    }
+    TRACE_EVENT( HistorySectorOpened, m_sector, m_sequence );
+}
+
+
+void FlashLog::measureFlashStall( int64_t start ) {
+    uint32_t duration = esp_timer_get_time() - start;
+    m_maxFlashStall = std::max( m_maxFlashStall, duration );
+    if ( duration > AdcRingTime ) {
+        ++m_flashOverruns;
+    }
+}
+
+}
@@ -0,0 +1,90 @@
+#include "history/reader.h"
+#include "util/half.h"
+
+
+namespace history {
+
+Reader::Reader( const FlashLog& log, uint32_t fromSequence ): 
+        m_log(log), m_fromSequence(fromSequence), m_sectorsVisited(0), 
+        m_headerLoaded(false), m_batchIndex(0), m_batchLoaded(false), m_position(0), 
+        m_activeEnergy(0.0) {
+    m_sector = oldestSector();
+}
+
+
+// The sector with the lowest sequence. The current sector can't be assumed to be the
+// newest one: it keeps the oldest records until the writer opens it
+size_t Reader::oldestSector() const {
+    size_t ret = 0;
+    bool found = false;
+    uint32_t oldest = 0;
+    for( size_t sector = 0; sector < m_log.sectors(); ++sector ) {
+        FlashLog::SectorHeader header;
+        if ( m_log.readHeader( sector, header ) && (!found || (header.sequence < oldest)) ) {
+            oldest = header.sequence;
+            ret = sector;
+            found = true;
+        }
+    }
+    return ret;
+}
+
+
+bool Reader::peek( Entry& entry ) {
+    if ( (!m_batchLoaded || (m_position == m_batch.size)) && !loadBatch() ) {
+        return false;
+    }
+
+    entry.sequence = m_header.sequence;
+    entry.boot = m_header.boot;
+    entry.uptime = m_batch.uptime + m_position;
+    entry.record = m_batch.records[m_position];
+    entry.activeEnergy = m_activeEnergy;
+    return true;
+}
+
+
+void Reader::advance() {
+    if ( m_batchLoaded && (m_position < m_batch.size) ) {
+        m_activeEnergy += half::toFloat( m_batch.records[m_position].activePower ) / 3600.0;
+        ++m_position;
+    }
+}
+
+
+bool Reader::loadBatch() {
+    if ( m_batchLoaded ) {
+        m_batchLoaded = false;
+        ++m_batchIndex;
+    }
+
+    while( m_sectorsVisited < m_log.sectors() ) {
+        if ( !m_headerLoaded ) {
+            if ( !m_log.readHeader( m_sector, m_header ) || (m_header.sequence < m_fromSequence) ) {
+                nextSector();
+                continue;
+            }
+            m_headerLoaded = true;
+            m_batchIndex = 0;
+            m_activeEnergy = m_header.activeEnergy;
+        }
+
+        if ( (m_batchIndex < FlashLog::BatchesPerSector) && 
+             m_log.readBatch( m_sector, m_batchIndex, m_batch ) && (m_batch.size > 0) ) {
+            m_batchLoaded = true;
+            m_position = 0;
+            return true;
+        }
+        nextSector();
+    }
+    return false;
+}
+
+
+void Reader::nextSector() {
+    m_headerLoaded = false;
+    ++m_sectorsVisited;
+    m_sector = (m_sector + 1) % m_log.sectors();
+}
+
+}
@@ -1,5 +1,6 @@
 #include "io/display.h"
 #include "util/trace.h"
+#include "util/tracering.h"
 #include "driver/i2c.h"
 #include "Adafruit_GFX.h"
 #include "font/dialog8pt.h"
@@ -10,32 +11,36 @@
 namespace io {
 
 
-void justify( SSD1306& lcd, int16_t y, const String& text,
-            std::function<int16_t (int16_t)> f ) {
-    int16_t x1, y1;
-    uint16_t w, h;
-    lcd.getTextBounds( text, 0, y, &x1, &y1, &w, &h );
-    lcd.setCursor( f(w), y );
-    lcd.print(text);
-}
-
-static void center( SSD1306& lcd, int16_t y, const String& text ) {
-    justify( lcd, y, text, [](int16_t width) { return Display::ScreenWidth/2 - (width/2); } );
-}
-
-
-static void right( SSD1306& lcd, int16_t y, const String& text ) {
-    justify( lcd, y, text, [](int16_t width) { return (Display::ScreenWidth - width)-3; } );
-}
-
-
 static String adjustUnit( float value, const char* unit ) {
     return (abs(value) < 0.1) ? 
                 String(value * 1000, 2) + " m" + unit :
                 String(value, 2) + " " + unit ;
 }
 
-Display::Display(): m_lcd(ScreenWidth, ScreenHeight) {
+Display::Display(): m_lcd(ScreenWidth, ScreenHeight), m_indicator(false) {
+    static const struct {
+        const GFXfont* font;
+        int16_t y;
+        Alignment alignment;
+    } layout[FieldsSize] = {
+        { &Dialog_plain_17, 15, FirstThird },       // FrequencyField
+        { &Dialog_plain_8,   8, Right },            // SampleRateField
+        { &Dialog_plain_13, 31, Left },             // VoltageField
+        { &Dialog_plain_13, 47, Left },             // CurrentField
+        { &Dialog_plain_13, 63, Left },             // ActivePowerField
+        { &Dialog_plain_8,  34, Right },            // ApparentPowerField
+        { &Dialog_plain_8,  47, Right },            // ReactivePowerField
+        { &Dialog_plain_8,  59, Right }             // PowerFactorField
+    };
+
+    for( size_t i = 0; i < FieldsSize; ++i ) {
+        TextField& field = m_fields[i];
+        field.font = layout[i].font;
+        field.y = layout[i].y;
+        field.alignment = layout[i].alignment;
+        field.dirty = false;
+        field.drawn = false;
+    }
 }
 
 void Display::init() {
@@ -48,42 +53,36 @@ void Display::init() {
 #else
     m_lcd.init();
 #endif
+    m_lcd.setTextColor( SSD1306::White );
 }
 
 
 void Display::update( const meter::CalculatedMeasures& measures ) {
-    m_lcd.clearDisplay();
-
+    uint64_t start = esp_timer_get_time();
     mainHeader( measures.signalFrequency(), measures.sampleRate() );
 
-    m_lcd.setFont(&Dialog_plain_13);
-    m_lcd.setCursor( 0, 31 );
     float voltage = (measures.signalFrequency() == 0) ? 
                     measures.voltage().mean() :
                     measures.voltage().rms();
-    m_lcd.print( String(voltage, 2) + " V" );
+    setText( VoltageField, String(voltage, 2) + " V" );
  
-    m_lcd.setCursor( 0, 47 );
     float current = (measures.signalFrequency() == 0) ? 
                     measures.current().mean() :
                     measures.current().rms();
-    m_lcd.print( adjustUnit(current, "A" ) );
+    setText( CurrentField, adjustUnit(current, "A" ) );
 
     const meter::PowerMeasure& power = measures.power();
-    m_lcd.setCursor( 0, 63 );
-    m_lcd.print( adjustUnit(power.active(), "W" ) );
-
-    m_lcd.setFont(&Dialog_plain_8);
-    right( m_lcd, 34, adjustUnit(power.apparent(), "VA") );
-    right( m_lcd, 47, adjustUnit(power.reactive(), "VAR") );
-    right( m_lcd, 59, String("PF: ") + String( power.factor(), 2 ) );
+    setText( ActivePowerField, adjustUnit(power.active(), "W" ) );
+    setText( ApparentPowerField, adjustUnit(power.apparent(), "VA") );
+    setText( ReactivePowerField, adjustUnit(power.reactive(), "VAR") );
+    setText( PowerFactorField, String("PF: ") + String( power.factor(), 2 ) );
 
+    render();
+    TRACE_EVENT( DisplayRendered, uint32_t(esp_timer_get_time() - start) );
     m_lcd.display();
 }
 
 void Display::mainHeader( uint32_t signalFrequency, uint32_t sampleRate ) {
-    m_lcd.setTextColor( SSD1306::White );
-    
     String title;
     if ( signalFrequency==0 )  {
         title = "DC";
@@ -95,19 +94,81 @@ void Display::mainHeader( uint32_t signalFrequency, uint32_t sampleRate ) {
         }
         title = str + " Hz";
     }
-    m_lcd.setFont(&Dialog_plain_17);
-    justify( m_lcd, 15, title, [](int16_t width) {
-        return Display::ScreenWidth/3 - (width/2); 
-    } );
+    setText( FrequencyField, title );
+    setText( SampleRateField, String(sampleRate, 10) );
+
+    m_indicator = !m_indicator;
+    m_lcd.fillRect( ScreenWidth-3, 13, 2, 2, m_indicator ? SSD1306::White : SSD1306::Black );
+}
 
-    m_lcd.setFont(&Dialog_plain_8);
-    right( m_lcd, 8, String(sampleRate, 10) );
 
-    static bool displayIndicator=false;
-    if ( displayIndicator ) {
-        m_lcd.drawRect( ScreenWidth-3, 13, 2, 2, SSD1306::White );
+void Display::setText( Field field, const String& text ) {
+    TextField& textField = m_fields[field];
+    if ( textField.drawn && (textField.text == text) ) {
+        return;
     }
-    displayIndicator = !displayIndicator;
+    textField.text = text;
+    textField.dirty = true;
+}
+
+
+// Erases the changed fields and renders them again, with the fields overlapping them
+void Display::render() {
+    for( size_t i = 0; i < FieldsSize; ++i ) {
+        TextField& field = m_fields[i];
+        if ( !field.dirty || !field.drawn ) {
+            continue;
+        }
+        m_lcd.fillRect( field.x1, field.y1, field.width, field.height, SSD1306::Black );
+        field.drawn = false;
+
+        for( size_t j = 0; j < FieldsSize; ++j ) {
+            if ( (j != i) && m_fields[j].drawn && intersects( field, m_fields[j] ) ) {
+                m_fields[j].dirty = true;
+            }
+        }
+    }
+
+    for( size_t i = 0; i < FieldsSize; ++i ) {
+        if ( m_fields[i].dirty ) {
+            drawField( m_fields[i] );
+        }
+    }
+}
+
+
+void Display::drawField( TextField& field ) {
+    m_lcd.setFont( field.font );
+    int16_t x1, y1;
+    uint16_t w, h;
+    m_lcd.getTextBounds( field.text, 0, field.y, &x1, &y1, &w, &h );
+
+    int16_t x = 0;
+    switch( field.alignment ) {
+        case Right:
+            x = (ScreenWidth - w) - 3;
+            break;
+        case FirstThird:
+            x = ScreenWidth/3 - (w/2);
+            break;
+        default:
+            break;
+    }
+    m_lcd.setCursor( x, field.y );
+    m_lcd.print( field.text );
+
+    field.x1 = x + x1;
+    field.y1 = y1;
+    field.width = w;
+    field.height = h;
+    field.dirty = false;
+    field.drawn = true;
+}
+
+
+bool Display::intersects( const TextField& field, const TextField& other ) {
+    return (field.x1 < other.x1 + other.width) && (other.x1 < field.x1 + field.width) &&
+           (field.y1 < other.y1 + other.height) && (other.y1 < field.y1 + field.height);
 }
 
 
@@ -0,0 +1,59 @@
+#include "io/glyphcache.h"
+#include <pgmspace.h>
+
+
+GlyphCache::GlyphCache( const GFXfont* font ): 
+        m_font(font),
+        m_first(pgm_read_byte(&font->first)),
+        m_last(pgm_read_byte(&font->last)),
+        m_valid(true) {
+    const uint8_t* bitmap = (const uint8_t*)pgm_read_ptr(&font->bitmap);
+    const GFXglyph* glyphs = (const GFXglyph*)pgm_read_ptr(&font->glyph);
+    const size_t count = m_last - m_first + 1;
+
+    size_t columns = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        columns += pgm_read_byte(&glyphs[i].width);
+        if ( pgm_read_byte(&glyphs[i].height) > MaxGlyphHeight ) {
+            m_valid = false;
+        }
+    }
+    if ( !m_valid ) {
+        return;
+    }
+    m_columns.assign( columns, 0 );
+    m_offsets.resize( count );
+
+    // Glyph bitmaps are rows of width bits, most significant bit first, without padding
+    // between rows
+    size_t column = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        const uint8_t* bits = bitmap + pgm_read_word(&glyphs[i].bitmapOffset);
+        uint8_t width = pgm_read_byte(&glyphs[i].width);
+        uint8_t height = pgm_read_byte(&glyphs[i].height);
+
+        m_offsets[i] = column;
+        size_t bit = 0;
+        for( uint8_t y = 0; y < height; ++y ) {
+            for( uint8_t x = 0; x < width; ++x, ++bit ) {
+                if ( pgm_read_byte(&bits[bit / 8]) & (0x80 >> (bit & 7)) ) {
+                    m_columns[column + x] |= (uint32_t(1) << y);
+                }
+            }
+        }
+        column += width;
+    }
+}
+
+GlyphCache::Glyph GlyphCache::glyph( uint8_t c ) const {
+    const GFXglyph* glyphs = (const GFXglyph*)pgm_read_ptr(&m_font->glyph);
+    const GFXglyph* source = &glyphs[c - m_first];
+    Glyph glyph;
+    glyph.columns = m_columns.data() + m_offsets[c - m_first];
+    glyph.width = pgm_read_byte(&source->width);
+    glyph.height = pgm_read_byte(&source->height);
+    glyph.xAdvance = pgm_read_byte(&source->xAdvance);
+    glyph.xOffset = pgm_read_byte(&source->xOffset);
+    glyph.yOffset = pgm_read_byte(&source->yOffset);
+    return glyph;
+}
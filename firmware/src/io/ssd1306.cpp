@@ -71,19 +71,39 @@ static esp_err_t send(const uint8_t *data, size_t size) {
 
 SSD1306::SSD1306(uint8_t w, uint8_t h): Adafruit_GFX(w, h), 
         m_buffer(NULL), 
-        m_size(w * ((h + 7) / 8)) {
+        m_frontBuffer(NULL),
+        m_sentBuffer(NULL),
+        m_pageBuffer(NULL),
+        m_size(w * ((h + 7) / 8)),
+        m_fullRefresh(true),
+        m_frontMutex(NULL),
+        m_flushTask(NULL),
+        m_drawPixel(&SSD1306::drawRotatedPixel<0>),
+        m_glyphCache(NULL) {
 }
 
 SSD1306::~SSD1306() {
-    i2c_driver_delete(I2C_NUM_0);
-    if ( m_buffer ) {
-        free( m_buffer );
+    if ( m_flushTask ) {
+        vTaskDelete( m_flushTask );
+    }
+    if ( m_frontMutex ) {
+        vSemaphoreDelete( m_frontMutex );
     }
+    i2c_driver_delete(I2C_NUM_0);
+    free( m_buffer );
+    free( m_frontBuffer );
+    free( m_sentBuffer );
+    free( m_pageBuffer );
 }
 
 void SSD1306::init() {
     m_buffer = (uint8_t *)malloc(m_size);
+    m_frontBuffer = (uint8_t *)malloc(m_size);
+    m_sentBuffer = (uint8_t *)malloc(m_size);
+    m_pageBuffer = (uint8_t *)malloc(WIDTH);
+    m_fullRefresh = true;
     clearDisplay();
+    m_frontMutex = xSemaphoreCreateMutex();
 
     i2c_master_init();
 
@@ -132,6 +152,7 @@ void SSD1306::init() {
         SSD1306_DISPLAYON}; // Main screen turn on
     TRACE_ESP_ERROR_CHECK(send(init5, sizeof(init5)));
 
+    xTaskCreatePinnedToCore( flushTask, "displayFlush", 2048, this, 1, &m_flushTask, 0 );
 }
 
 void SSD1306::clearDisplay() {
@@ -139,52 +160,275 @@ void SSD1306::clearDisplay() {
 }
 
 void SSD1306::display() {
-     static uint8_t dlist1[] = {
+    xSemaphoreTake( m_frontMutex, portMAX_DELAY );
+    memcpy( m_frontBuffer, m_buffer, m_size );
+    xSemaphoreGive( m_frontMutex );
+    xTaskNotifyGive( m_flushTask );
+}
+
+void SSD1306::flushTask( void* arg ) {
+    SSD1306* self = static_cast<SSD1306*>(arg);
+    while( true ) {
+        ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+        self->flush();
+    }
+}
+
+// The front buffer is only locked to find and copy the changes of one page, never
+// while sending
+void SSD1306::flush() {
+    const size_t pages = m_size / WIDTH;
+    for( size_t page = 0; page < pages; ++page ) {
+        size_t first, last;
+        xSemaphoreTake( m_frontMutex, portMAX_DELAY );
+        bool changed = findChanges( page, first, last );
+        if ( changed ) {
+            memcpy( m_pageBuffer + first, m_frontBuffer + page * WIDTH + first, last - first + 1 );
+        }
+        xSemaphoreGive( m_frontMutex );
+
+        if ( changed ) {
+            sendPage( page, first, last );
+        }
+    }
+}
+
+bool SSD1306::findChanges( size_t page, size_t& firstColumn, size_t& lastColumn ) {
+    // Display RAM content is unknown after init
+    if ( m_fullRefresh ) {
+        m_fullRefresh = false;
+        for( size_t i = 0; i < m_size; ++i ) {
+            m_sentBuffer[i] = ~m_frontBuffer[i];
+        }
+    }
+
+    const size_t width = WIDTH;
+    const uint8_t* current = m_frontBuffer + page * width;
+    const uint8_t* sent = m_sentBuffer + page * width;
+
+    size_t first = 0;
+    while( (first < width) && (current[first] == sent[first]) ) {
+        ++first;
+    }
+    if ( first == width ) {
+        return false;
+    }
+    size_t last = width - 1;
+    while( current[last] == sent[last] ) {
+        --last;
+    }
+
+    firstColumn = first;
+    lastColumn = last;
+    return true;
+}
+
+// The sent buffer is only updated when the display has acknowledged both the address and
+// the data, so the columns of a failed transfer are sent again by the next flush
+void SSD1306::sendPage( size_t page, size_t firstColumn, size_t lastColumn ) {
+    const uint8_t address[] = {
         SSD1306_PAGEADDR,
-        0,                         // Page start address
-        0xFF,                      // Page end (not really, but works here)
+        static_cast<uint8_t>(page),
+        static_cast<uint8_t>(page),
         SSD1306_COLUMNADDR,
-        0,
-        static_cast<uint8_t>(WIDTH-1) };                       // Column start address
-    TRACE_ESP_ERROR_CHECK(send(dlist1, sizeof(dlist1)));
-    
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    i2c_master_start(cmd);
-    i2c_master_write_byte(cmd, 0x3C << 1 | 0, 1);
-    i2c_master_write_byte(cmd, 0x40, 1);       // Co = 0, D/C = 0
-    i2c_master_write(cmd, m_buffer, m_size, 1);
-    i2c_master_stop(cmd);
-    TRACE_ESP_ERROR_CHECK(i2c_master_cmd_begin(I2C_NUM_0, cmd, 1000 / portTICK_RATE_MS));
-    i2c_cmd_link_delete(cmd);
+        static_cast<uint8_t>(firstColumn),
+        static_cast<uint8_t>(lastColumn) };
+    esp_err_t err = send(address, sizeof(address));
+
+    uint8_t* data = m_pageBuffer + firstColumn;
+    size_t size = lastColumn - firstColumn + 1;
+    if ( err == ESP_OK ) {
+        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, 0x3C << 1 | 0, 1);
+        i2c_master_write_byte(cmd, 0x40, 1);       // Co = 0, D/C = 1
+        i2c_master_write(cmd, data, size, 1);
+        i2c_master_stop(cmd);
+        err = i2c_master_cmd_begin(I2C_NUM_0, cmd, 1000 / portTICK_RATE_MS);
+        i2c_cmd_link_delete(cmd);
+    }
+    if ( err != ESP_OK ) {
+        TRACE_ERROR( "Display page %u not sent: %d", page, err );
+        return;
+    }
+
+    memcpy( m_sentBuffer + page * WIDTH + firstColumn, data, size );
 }
 
 void SSD1306::drawPixel(int16_t x, int16_t y, uint16_t color) {
-    if ((x >= 0) && (x < width()) && (y >= 0) && (y < height()))  {
-        // Pixel is in-bounds. Rotate coordinates if needed.
-        switch (getRotation()) {
-        case 1:
-            ssd1306_swap(x, y);
-            x = WIDTH - x - 1;
-            break;
-        case 2:
-            x = WIDTH - x - 1;
-            y = HEIGHT - y - 1;
-            break;
-        case 3:
-            ssd1306_swap(x, y);
-            y = HEIGHT - y - 1;
-            break;
+    (this->*m_drawPixel)( x, y, color );
+}
+
+void SSD1306::setRotation(uint8_t r) {
+    Adafruit_GFX::setRotation(r);
+    switch (getRotation()) {
+    case 1:
+        m_drawPixel = &SSD1306::drawRotatedPixel<1>;
+        break;
+    case 2:
+        m_drawPixel = &SSD1306::drawRotatedPixel<2>;
+        break;
+    case 3:
+        m_drawPixel = &SSD1306::drawRotatedPixel<3>;
+        break;
+    default:
+        m_drawPixel = &SSD1306::drawRotatedPixel<0>;
+        break;
+    }
+}
+
+template <uint8_t Rotation>
+void SSD1306::drawRotatedPixel(int16_t x, int16_t y, uint16_t color) {
+    if ((x < 0) || (x >= _width) || (y < 0) || (y >= _height)) {
+        return;
+    }
+    switch (Rotation) {
+    case 1:
+        ssd1306_swap(x, y);
+        x = WIDTH - x - 1;
+        break;
+    case 2:
+        x = WIDTH - x - 1;
+        y = HEIGHT - y - 1;
+        break;
+    case 3:
+        ssd1306_swap(x, y);
+        y = HEIGHT - y - 1;
+        break;
+    }
+    setBits( m_buffer[x + (y / 8) * WIDTH], 1 << (y & 7), color );
+}
+
+void SSD1306::drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
+    fillRect( x, y, w, 1, color );
+}
+
+void SSD1306::drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
+    fillRect( x, y, 1, h, color );
+}
+
+// The rectangle is clipped and rotated to display coordinates, where it is still a rectangle
+void SSD1306::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
+    if ( w < 0 ) {
+        x += w + 1;
+        w = -w;
+    }
+    if ( h < 0 ) {
+        y += h + 1;
+        h = -h;
+    }
+    if ( x < 0 ) {
+        w += x;
+        x = 0;
+    }
+    if ( y < 0 ) {
+        h += y;
+        y = 0;
+    }
+    if ( x + w > _width ) {
+        w = _width - x;
+    }
+    if ( y + h > _height ) {
+        h = _height - y;
+    }
+    if ( (w <= 0) || (h <= 0) ) {
+        return;
+    }
+
+    switch (getRotation()) {
+    case 1:
+        fillDisplayRect( WIDTH - y - h, x, h, w, color );
+        break;
+    case 2:
+        fillDisplayRect( WIDTH - x - w, HEIGHT - y - h, w, h, color );
+        break;
+    case 3:
+        fillDisplayRect( y, HEIGHT - x - w, h, w, color );
+        break;
+    default:
+        fillDisplayRect( x, y, w, h, color );
+        break;
+    }
+}
+
+// Writes one byte per column in each page covered, masked in the first and last pages
+void SSD1306::fillDisplayRect( int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color ) {
+    const int16_t lastRow = y + h - 1;
+    for( int16_t page = y / 8; page <= lastRow / 8; ++page ) {
+        uint8_t mask = 0xFF;
+        if ( page == y / 8 ) {
+            mask &= 0xFF << (y & 7);
+        }
+        if ( page == lastRow / 8 ) {
+            mask &= 0xFF >> (7 - (lastRow & 7));
         }
-        switch (color) {
-        case White:
-            m_buffer[x + (y / 8) * WIDTH] |= (1 << (y & 7));
-            break;
-        case Black:
-            m_buffer[x + (y / 8) * WIDTH] &= ~(1 << (y & 7));
-            break;
-        case Inverse:
-            m_buffer[x + (y / 8) * WIDTH] ^= (1 << (y & 7));
-            break;
+        uint8_t* data = m_buffer + page * WIDTH + x;
+        for( int16_t i = 0; i < w; ++i ) {
+            setBits( data[i], mask, color );
         }
     }
 }
+
+void SSD1306::setBits( uint8_t& data, uint8_t mask, uint16_t color ) {
+    switch (color) {
+    case White:
+        data |= mask;
+        break;
+    case Black:
+        data &= ~mask;
+        break;
+    case Inverse:
+        data ^= mask;
+        break;
+    }
+}
+
+size_t SSD1306::write(uint8_t c) {
+    if ( SSD1306_GFX_TEXT || (gfxFont == NULL) || (getRotation() != 0) || 
+         (textsize_x != 1) || (textsize_y != 1) ) {
+        return Adafruit_GFX::write(c);
+    }
+    const GlyphCache* cache = glyphCache();
+    if ( cache == NULL ) {
+        return Adafruit_GFX::write(c);
+    }
+
+    if ( c == '\n' ) {
+        cursor_x = 0;
+        cursor_y += (uint8_t)pgm_read_byte(&gfxFont->yAdvance);
+    }
+    else if ( (c != '\r') && cache->contains(c) ) {
+        GlyphCache::Glyph glyph = cache->glyph(c);
+        if ( (glyph.width > 0) && (glyph.height > 0) ) {
+            if ( wrap && ((cursor_x + glyph.xOffset + glyph.width) > _width) ) {
+                cursor_x = 0;
+                cursor_y += (uint8_t)pgm_read_byte(&gfxFont->yAdvance);
+            }
+            drawGlyph( glyph, cursor_x, cursor_y, textcolor );
+        }
+        cursor_x += glyph.xAdvance;
+    }
+    return 1;
+}
+
+const GlyphCache* SSD1306::glyphCache() {
+    if ( (m_glyphCache != NULL) && (m_glyphCache->font() == gfxFont) ) {
+        return m_glyphCache;
+    }
+    m_glyphCache = NULL;
+    for( const GlyphCache& cache : m_glyphCaches ) {
+        if ( cache.font() == gfxFont ) {
+            m_glyphCache = &cache;
+        }
+    }
+    if ( m_glyphCache == NULL ) {
+        m_glyphCaches.emplace_back( gfxFont );
+        m_glyphCache = &m_glyphCaches.back();
+    }
+    return m_glyphCache->valid() ? m_glyphCache : NULL;
+}
+
+void SSD1306::drawGlyph( const GlyphCache::Glyph& glyph, int16_t x, int16_t y, uint16_t color ) {
+    GlyphCache::draw( glyph, m_buffer, WIDTH, m_size / WIDTH, x, y, 
+                      [color]( uint8_t& data, uint8_t mask ) { setBits( data, mask, color ); } );
+}
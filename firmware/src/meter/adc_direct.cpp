@@ -1,5 +1,6 @@
 #include "meter/adc_direct.h"
 #include "util/trace.h"
+#include "util/tracering.h"
 #include "util/indicator.h"
 #include "driver/timer.h"
 #include "soc/sens_struct.h"
@@ -9,6 +10,8 @@
 #include <algorithm>
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "rom/ets_sys.h"
+#include "xtensa/core-macros.h"
 
 namespace adc {
 
@@ -24,7 +27,7 @@ struct TimedBuffer {
 
 static std::list<adc1_channel_t> channels;
 static intr_handle_t timerIsrHandle;
-static TimedBuffer buffers[BufferCount+1];
+static TimedBuffer buffers[QueuedBuffers+1];
 
 inline uint16_t local_adc1_read(int channel) {
     SENS.sar_meas_start1.sar1_en_pad = (1 << channel); // only one channel is selected
@@ -41,18 +44,31 @@ static int writeBufferIndex;
 static int readBufferIndex;
 static QueueHandle_t readBufferQueue;
 
+static volatile uint32_t producedBuffers;
+static volatile uint32_t consumedBuffers;
+static volatile uint32_t droppedBuffers;
+static volatile uint32_t isrMaxCycles;
+
+static adc1_channel_t referenceChannel = ADC1_CHANNEL_MAX;
+static uint32_t referenceCountdown;
+static ReferenceReadings referenceReadings;
+static portMUX_TYPE referenceMux = portMUX_INITIALIZER_UNLOCKED;
+
 inline int nextBuffer( int currentIndex ) {
-    if ( ++currentIndex == BufferCount+1 ) {
+    if ( ++currentIndex == QueuedBuffers+1 ) {
         return 0;
     }
     return currentIndex;
 }
 
 inline void sendToQueue( int bufferIndex ) {
+    ++producedBuffers;
     if ( xQueueIsQueueFullFromISR(readBufferQueue) ) {
         int dummy1;
         BaseType_t dummy2; 
         xQueueReceiveFromISR(readBufferQueue, &dummy1, &dummy2);
+        ++droppedBuffers;
+        TRACE_EVENT( AdcBufferDropped, dummy1 );
     }
     BaseType_t higherPriorityTaskWoken;
     xQueueSendToBackFromISR( readBufferQueue, &bufferIndex, &higherPriorityTaskWoken );
@@ -81,6 +97,7 @@ inline void changeWriteBuffer() {
 }
 
 static void IRAM_ATTR timerIsr(void* arg) {
+    uint32_t beginCycles = XTHAL_GET_CCOUNT();
     TIMERG0.int_clr_timers.t0 = 1;
     TIMERG0.hw_timer[0].config.alarm_en = 1;
 
@@ -92,6 +109,20 @@ static void IRAM_ATTR timerIsr(void* arg) {
             changeWriteBuffer();
         }
     }
+
+    if ( (referenceChannel != ADC1_CHANNEL_MAX) && (--referenceCountdown == 0) ) {
+        referenceCountdown = ReferenceInterval;
+        uint16_t value = local_adc1_read(referenceChannel);
+        portENTER_CRITICAL_ISR(&referenceMux);
+        referenceReadings.sum += value;
+        ++referenceReadings.count;
+        portEXIT_CRITICAL_ISR(&referenceMux);
+    }
+
+    uint32_t cycles = XTHAL_GET_CCOUNT() - beginCycles;
+    if ( cycles > isrMaxCycles ) {
+        isrMaxCycles = cycles;
+    }
 }
 
 
@@ -123,8 +154,21 @@ void start( const nonstd::span<const adc1_channel_t>& channels ){
         adc1_get_raw(channel);
     });
 
+    if ( referenceChannel != ADC1_CHANNEL_MAX ) {
+        adc1_config_channel_atten(referenceChannel, ADC_ATTEN_DB_0);
+        adc1_get_raw(referenceChannel);
+    }
+    referenceCountdown = ReferenceInterval;
+    referenceReadings.sum = 0;
+    referenceReadings.count = 0;
+
+    producedBuffers = 0;
+    consumedBuffers = 0;
+    droppedBuffers = 0;
+    isrMaxCycles = 0;
+
     setWriteBuffer(0);
-    readBufferQueue = xQueueCreate( BufferCount, sizeof(int) );
+    readBufferQueue = xQueueCreate( QueuedBuffers, sizeof(int) );
     startTimer( channels.size() );
 }
 
@@ -139,18 +183,43 @@ void stop() {
 
 
 
+void setReferenceChannel( adc1_channel_t channel ) {
+    referenceChannel = channel;
+}
+
+ReferenceReadings takeReferenceReadings() {
+    portENTER_CRITICAL(&referenceMux);
+    ReferenceReadings ret = referenceReadings;
+    referenceReadings.sum = 0;
+    referenceReadings.count = 0;
+    portEXIT_CRITICAL(&referenceMux);
+    return ret;
+}
+
+
 // Returns time in us when the first value was sampled
 int64_t readData( Buffer& buffer ) {
     if( !xQueueReceive( readBufferQueue, &readBufferIndex, portMAX_DELAY ) ) {
         TRACE_ERROR_AND_RETURN(-1);
     }
- //   TRACE("Read: %d", readBufferIndex);
+    TRACE_EVENT( AdcBufferRead, readBufferIndex );
 
     const TimedBuffer& readBuffer = buffers[readBufferIndex];
     memcpy( buffer.data(), readBuffer.buffer.data(), BufferSize * sizeof(Buffer::value_type) );
+    ++consumedBuffers;
     return readBuffer.startTime;
 }
 
+
+Stats stats() {
+    Stats ret;
+    ret.produced = producedBuffers;
+    ret.consumed = consumedBuffers;
+    ret.dropped = droppedBuffers;
+    ret.isrMaxDuration = isrMaxCycles / ets_get_cpu_frequency();
+    return ret;
+}
+
 }
 
 }
@@ -1,9 +1,10 @@
-#include "meter/adc.h"
+#include "meter/adc_dma.h"
 #include "util/trace.h"
 #include "driver/i2s.h"
 #include "soc/syscon_reg.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/portmacro.h"
+#include "freertos/queue.h"
 
 extern "C" {
 #include "soc/syscon_struct.h"
@@ -54,6 +55,33 @@ static esp_err_t adc_set_i2s_data_pattern(adc_unit_t adc_unit,
 }
 
 
+// The I2S driver posts an event per DMA buffer filled. Events are only used to count
+// produced buffers, so the queue must be large enough to not lose them between reads.
+static const size_t EventQueueSize = 16;
+static QueueHandle_t eventQueue;
+
+static uint32_t producedBuffers;
+static uint32_t consumedBuffers;
+static uint32_t droppedBuffers;
+
+
+static void countProducedBuffers() {
+    i2s_event_t event;
+    while( xQueueReceive( eventQueue, &event, 0 ) ) {
+        if ( event.type == I2S_EVENT_RX_DONE ) {
+            ++producedBuffers;
+        }
+    }
+
+    // The driver discards the oldest DMA buffer when all of them are full and
+    // not read. Buffers not yet read can't be more than the DMA buffers.
+    int32_t pending = producedBuffers - consumedBuffers - droppedBuffers;
+    if ( pending > static_cast<int32_t>(adc::BufferCount) ) {
+        droppedBuffers += pending - adc::BufferCount;
+    }
+}
+
+
 static void clearRxBuffer() {
     Buffer buffer;
     size_t bytesRead = 0;
@@ -80,7 +108,7 @@ void start( const nonstd::span<const adc1_channel_t>& channels ) {
 	};
 
     //install and start i2s driver
-    i2s_driver_install(I2S_NUM_0, &i2s_config, 0, NULL);
+    i2s_driver_install(I2S_NUM_0, &i2s_config, EventQueueSize, &eventQueue);
 
 	nonstd::span<adc1_channel_t>::const_iterator it = channels.begin();
 	i2s_set_adc_mode(ADC_UNIT_1, static_cast<adc1_channel_t>(*it));
@@ -107,6 +135,10 @@ void start( const nonstd::span<const adc1_channel_t>& channels ) {
     portEXIT_CRITICAL(&rtc_spinlock);
 
     clearRxBuffer();
+    xQueueReset( eventQueue );
+    producedBuffers = 0;
+    consumedBuffers = 0;
+    droppedBuffers = 0;
 }
 
 
@@ -127,9 +159,32 @@ int64_t readData( Buffer& buffer ) {
                                     &bytesRead, 
                                     portMAX_DELAY ));
     assert( bytesRead == BufferBytes );
+    ++consumedBuffers;
+    countProducedBuffers();
 	return esp_timer_get_time() - (1000000ULL * adc::BufferSize / SampleRate);
 }
 
+
+void setReferenceChannel( adc1_channel_t ) {
+}
+
+ReferenceReadings takeReferenceReadings() {
+    ReferenceReadings ret;
+    ret.sum = 0;
+    ret.count = 0;
+    return ret;
+}
+
+
+Stats stats() {
+    Stats ret;
+    ret.produced = producedBuffers;
+    ret.consumed = consumedBuffers;
+    ret.dropped = droppedBuffers;
+    ret.isrMaxDuration = 0;
+    return ret;
+}
+
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "meter/burst.h"
+#include "util/tracering.h"
+#include "util/pack12.h"
+#include <algorithm>
+#include <stddef.h>
+
+
+namespace meter {
+
+static_assert( sizeof(Burst::Packet) == offsetof(Burst::Packet, data) + Burst::PackedBufferSize,
+               "Packets are sent as is, without padding" );
+
+bool Burst::start( size_t buffers ) {
+    if ( active() || (buffers == 0) ) {
+        return false;
+    }
+    m_sequence = 0;
+    m_remaining = std::min( buffers, MaxBuffers );
+    TRACE_EVENT( BurstStarted, m_remaining );
+    return true;
+}
+
+
+void Burst::stop() {
+    m_remaining = 0;
+}
+
+
+// The buffer is claimed before recording it. stop() can zero the count from another task
+// at any time, so it's never decremented below 0
+void Burst::record( const adc::Buffer& buffer, uint64_t time ) {
+    uint32_t remaining = m_remaining.load();
+    do {
+        if ( remaining == 0 ) {
+            return;
+        }
+    } while( !m_remaining.compare_exchange_weak( remaining, remaining - 1 ) );
+
+    Packet& packet = m_queue.back();
+    packet.time = time;
+    packet.sequence = m_sequence++;
+    packet.samples = adc::BufferSize;
+    packet.channelsSize = m_sequenceSize;
+    packet.reserved = 0;
+    std::fill( packet.channels, packet.channels + adc::MaxSequenceSize, 0 );
+    pack12::sequence( buffer, nonstd::span<uint8_t>( packet.channels, m_sequenceSize ) );
+    pack12::pack( buffer, packet.data );
+    if ( !m_queue.push() ) {
+        TRACE_EVENT( BurstPacketDropped, packet.sequence );
+    }
+
+    if ( remaining == 1 ) {
+        TRACE_EVENT( BurstCompleted, m_sequence, m_queue.dropped() );
+    }
+}
+
+}
@@ -1,4 +1,5 @@
 #include "meter/calculatedmeter.h"
+#include "util/tracering.h"
 #include <cmath>
 
 namespace meter {
@@ -14,12 +15,17 @@ static const size_t MeasuresPerSecond = adc::SampleRate / adc::SamplesGroupSize;
 static const size_t SamplesInChunk = MeasuresPerSecond * 1 ;
 
 
-CalculatorBasedMeter::CalculatorBasedMeter() {
+CalculatorBasedMeter::CalculatorBasedMeter(): 
+        m_voltageScaleFactor(0.0), m_currentScaleFactor(0.0), 
+        m_lastTimeFetched(0), m_fetchInterval(0) {
     m_valueQueue = xQueueCreate( 1, sizeof(Measures) );
+    m_lastValueQueue = xQueueCreate( 1, sizeof(Measures) );
+    reset();
 }
 
 CalculatorBasedMeter::~CalculatorBasedMeter() {
     vQueueDelete(m_valueQueue);
+    vQueueDelete(m_lastValueQueue);
 }
 
 CalculatorBasedMeter::Measures CalculatorBasedMeter::get() {
@@ -28,20 +34,41 @@ CalculatorBasedMeter::Measures CalculatorBasedMeter::get() {
     return ret;
 }
 
+bool CalculatorBasedMeter::last( Measures& measures ) {
+    return xQueuePeek( m_lastValueQueue, &measures, 0 );
+}
+
+// Only the sign of the last voltage is used, and it doesn't change with the scale
 void CalculatorBasedMeter::scaleFactors( const std::pair<float, float>& factors ) {
+    if ( (m_voltageScaleFactor != 0.0) && (m_currentScaleFactor != 0.0) ) {
+        double voltageFactor = double(m_voltageScaleFactor) / factors.first;
+        double currentFactor = double(m_currentScaleFactor) / factors.second;
+        m_periodAccumulator.rescale( voltageFactor, currentFactor );
+        m_accumulator.rescale( voltageFactor, currentFactor );
+    }
     m_voltageScaleFactor = factors.first;
     m_currentScaleFactor = factors.second;
-    reset();
 }
 
 
-bool CalculatorBasedMeter::process( uint64_t time, const SampleBasedMeter::Measures& samples ) {
-    typedef SampleBasedMeter::Measure SampledMeasure;
+bool CalculatorBasedMeter::process( const SampleBasedMeter::Measures& samples ) {
+    typedef SampleBasedMeter::Measures::Values Values;
+
+    // Blocks taken after a range change come with other scale factors. Values already
+    // accumulated are converted to them, so the chunk keeps the samples of both ranges.
+    const std::pair<float, float>& blockScaleFactors = samples.scaleFactors();
+    if ( (blockScaleFactors.first != m_voltageScaleFactor) || 
+         (blockScaleFactors.second != m_currentScaleFactor) ) {
+        scaleFactors( blockScaleFactors );
+    }
+    m_quality |= samples.quality();
+
     bool chunkCompleted = false;
-    std::for_each( samples.begin(), samples.end(), 
-                [this, &chunkCompleted]( const SampledMeasure& sampledMeasure ) {
-        int16_t voltage = sampledMeasure.voltage();
-        int16_t current = sampledMeasure.current();
+    const Values& voltages = samples.voltage();
+    const Values& currents = samples.current();
+    for( size_t i = 0; i < voltages.size(); ++i ) {
+        int16_t voltage = voltages[i];
+        int16_t current = currents[i];
         m_periodAccumulator.accumulate( voltage, current );        
 
         if ( (m_lastVoltage > 0) && (voltage <= 0) ) {
@@ -52,10 +79,14 @@ bool CalculatorBasedMeter::process( uint64_t time, const SampleBasedMeter::Measu
         m_lastVoltage = voltage;
 
         if ( ++m_processedSamples > SamplesInChunk ) {
+            TRACE_EVENT( ChunkCalculated, m_processedSamples, m_sampledPeriods );
             fetch();
+            if ( i+1 < voltages.size() ) {
+                m_quality = samples.quality();  // The rest of the block goes to the next chunk
+            }
             chunkCompleted = true;
         }
-    });
+    }
 
     return chunkCompleted;
 }
@@ -68,6 +99,7 @@ void CalculatorBasedMeter::reset() {
     m_lastVoltage = 0;
     m_processedSamples = 0;
     m_sampledPeriods = 0;
+    m_quality = 0;
 }
 
 
@@ -95,9 +127,12 @@ void CalculatorBasedMeter::fetch() {
 
     int32_t sampleRate, signalFrequency;
     std::tie(sampleRate, signalFrequency) = fetchTimes();
+    m_energy.accumulate( power, m_fetchInterval );
 
-    Measures measures = Measures(sampleRate, signalFrequency, voltage, current, power); 
+    Measures measures = Measures(sampleRate, signalFrequency, voltage, current, power, m_energy, 
+                                 m_quality); 
     xQueueOverwrite( m_valueQueue, &measures );
+    xQueueOverwrite( m_lastValueQueue, &measures );
     reset();
 }
 
@@ -107,6 +142,7 @@ std::pair<uint32_t, uint32_t> CalculatorBasedMeter::fetchTimes() {
     m_lastTimeFetched = esp_timer_get_time();           // In us
     uint32_t interval = m_lastTimeFetched-lastTime;
     interval /= 1000;                                   // In ms
+    m_fetchInterval = (lastTime == 0) ? 0 : interval;   // First interval isn't a chunk
 
     uint32_t samples = m_processedSamples * (adc::SamplesGroupSize * 1000UL);
     
@@ -0,0 +1,188 @@
+#include "meter/capture.h"
+#include "util/tracering.h"
+#include "util/trace.h"
+#include "util/extram.h"
+#include "util/cachelinewriter.h"
+#include <cmath>
+#include <algorithm>
+#include <new>
+
+
+namespace meter {
+
+static_assert( (sizeof(Capture::Record) % CacheLineWriter::LineSize == 0) &&
+               (extram::Alignment % CacheLineWriter::LineSize == 0), 
+               "Capture records must be written in whole cache lines" );
+
+static const char* triggerNames[Capture::TriggersSize] = {
+    "manual",
+    "voltage",
+    "current",
+    "overflow"
+};
+
+
+Capture::Capture( size_t sequenceSize ): m_sequenceSize(sequenceSize), m_records(NULL), m_capacity(0), m_external(false), m_state(Idle), m_manualTrigger(false), m_trigger(ManualTrigger), 
+                    m_level(0.0), m_preTriggerBuffers(0), m_postTriggerBuffers(0), 
+                    m_next(0), m_recorded(0), m_first(0), m_triggerSample(0), m_triggerGroup(-1) {
+}
+
+
+Capture::~Capture() {
+    if ( m_external ) {
+        extram::release( m_records );
+    }
+    else {
+        delete[] m_records;
+    }
+}
+
+
+bool Capture::init() {
+    size_t buffers = std::min( ExternalBuffers, extram::largestFreeBlock() / sizeof(Record) );
+    if ( buffers > InternalBuffers ) {
+        m_records = static_cast<Record*>( extram::allocate( buffers * sizeof(Record) ) );
+    }
+    m_external = (m_records != NULL);
+    if ( !m_external ) {
+        buffers = InternalBuffers;
+        m_records = new (std::nothrow) Record[buffers];
+    }
+    m_capacity = (m_records != NULL) ? buffers : 0;
+    TRACE( "Capture of %u buffers in %s RAM", m_capacity, m_external ? "external" : "internal" );
+    return m_capacity > 0;
+}
+
+
+const char* Capture::triggerName( Trigger trigger ) {
+    return (trigger < TriggersSize) ? triggerNames[trigger] : "unknown";
+}
+
+
+bool Capture::arm( Trigger trigger, float level, size_t preTriggerBuffers ) {
+    State current = state();
+    if ( (current == Armed) || (current == Triggered) || 
+         (trigger >= TriggersSize) || (preTriggerBuffers >= m_capacity) ) {
+        return false;
+    }
+
+    // The acquisition task doesn't touch the settings until the state is Armed
+    m_trigger = trigger;
+    m_level = std::fabs( level );
+    m_preTriggerBuffers = preTriggerBuffers;
+    m_next = 0;
+    m_recorded = 0;
+    m_first = 0;
+    m_triggerSample = 0;
+    m_triggerGroup = -1;
+    m_manualTrigger = false;
+    m_state.store( Armed, std::memory_order_release );
+    return true;
+}
+
+
+void Capture::trigger() {
+    m_manualTrigger = true;
+}
+
+
+void Capture::cancel() {
+    State expected = Armed;
+    if ( !m_state.compare_exchange_strong( expected, Idle ) ) {
+        expected = Triggered;
+        m_state.compare_exchange_strong( expected, Idle );
+    }
+}
+
+
+void Capture::record( const adc::Buffer& buffer, uint64_t time ) {
+    State current = state();
+    if ( (current != Armed) && (current != Triggered) ) {
+        return;
+    }
+
+    Record& record = m_external ? m_staging : m_records[m_next];
+    record.time = time;
+    record.channelsSize = m_sequenceSize;
+    std::fill( record.channels, record.channels + adc::MaxSequenceSize, 0 );
+    pack12::sequence( buffer, nonstd::span<uint8_t>( record.channels, m_sequenceSize ) );
+    pack12::pack( buffer, record.data );
+    if ( m_external ) {
+        CacheLineWriter writer( &m_records[m_next], sizeof(Record) );
+        writer.write( &m_staging, sizeof(Record) );
+    }
+    m_next = (m_next + 1) % m_capacity;
+    if ( current == Armed ) {
+        // Only the last pre-trigger buffers and the one being checked are kept
+        m_recorded = std::min( m_recorded + 1, m_preTriggerBuffers + 1 );
+    }
+    else {
+        ++m_recorded;
+    }
+}
+
+
+void Capture::check( const MeasuresBlock& block, bool overflow ) {
+    State current = state();
+    if ( current == Armed ) {
+        if ( !isTriggered( block, overflow ) ) {
+            return;
+        }
+        // The trigger buffer is the last one recorded. The rest of the ring is for
+        // post-trigger buffers
+        m_triggerSample = (m_recorded - 1) * adc::BufferSize + m_triggerGroup * adc::SamplesGroupSize;
+        m_postTriggerBuffers = m_capacity - m_recorded;
+        m_state.store( Triggered, std::memory_order_release );
+        TRACE_EVENT( CaptureTriggered, m_trigger, m_triggerSample );
+    }
+    else if ( current == Triggered ) {
+        --m_postTriggerBuffers;
+    }
+    else {
+        return;
+    }
+
+    if ( m_postTriggerBuffers == 0 ) {
+        m_first = (m_next + m_capacity - m_recorded) % m_capacity;
+        m_state.store( Completed, std::memory_order_release );
+        TRACE_EVENT( CaptureCompleted, m_recorded );
+    }
+}
+
+
+// A manual trigger fires any armed capture
+bool Capture::isTriggered( const MeasuresBlock& block, bool overflow ) {
+    m_triggerGroup = 0;
+    if ( m_manualTrigger.exchange(false) ) {
+        return true;
+    }
+
+    switch( m_trigger ) {
+        case VoltageTrigger:
+            m_triggerGroup = findLevel( block.voltage(), block.scaleFactors().first, m_level );
+            return m_triggerGroup >= 0;
+        case CurrentTrigger:
+            m_triggerGroup = findLevel( block.current(), block.scaleFactors().second, m_level );
+            return m_triggerGroup >= 0;
+        case OverflowTrigger:
+            return overflow;
+        default:
+            return false;
+    }
+}
+
+
+// Returns the position of the first value with an absolute value over level or -1
+int Capture::findLevel( const MeasuresBlock::Values& values, float scaleFactor, float level ) {
+    if ( scaleFactor <= 0.0 ) {
+        return -1;
+    }
+    int32_t threshold = std::ceil( level / scaleFactor );
+    MeasuresBlock::Values::const_iterator it = std::find_if( values.begin(), values.end(), 
+            [threshold]( int16_t value ) {
+                return std::abs( static_cast<int32_t>(value) ) >= threshold;
+            });
+    return (it == values.end()) ? -1 : std::distance( values.begin(), it );
+}
+
+}
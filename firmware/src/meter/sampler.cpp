@@ -10,6 +10,8 @@
 #include "soc/rtc.h"
 #include "esp_event_loop.h"
 #include "esp_adc_cal.h"
+#include "nvs.h"
+#include "rom/crc.h"
 
 #include <algorithm>
 #include <iterator>
@@ -19,13 +21,14 @@
 
 namespace meter {
 
-static bool adcToVoltageInitialized = false;
-static uint16_t adcToVoltage[4096];
 static uint32_t adcVref = 1108;			// default value. Value in mV
 
 
 namespace _ {
 
+bool adcModelInitialized = false;
+AdcSegment adcModel[AdcSegments];
+
 static bool adcCharacterized = false;
 static esp_adc_cal_characteristics_t adcCalCharacteristics;
 
@@ -38,10 +41,6 @@ uint16_t rawToMilliVolts( uint16_t value ) {
 	return esp_adc_cal_raw_to_voltage(value, &adcCalCharacteristics);
 }
 
-uint16_t rawToTenthsOfMilliVolt( uint16_t value ) {
-    return adcToVoltageInitialized ? adcToVoltage[value] : rawToMilliVolts(value)*10;
-}
-
 }
 
 
@@ -54,115 +53,158 @@ void routeVref( gpio_num_t gpio ) {
 }
 
 
-static uint16_t rawRead( adc1_channel_t channel ) {
-    static const int N_BUFFERS = 1;
-    uint32_t total = 0;
-    for( int i=0; i<N_BUFFERS; ++i ) {
-        adc::Buffer values;
-        adc::ADC_IMPL::readData( values );
-        total = std::accumulate( values.begin(), values.end(), total, 
-                            [&](uint32_t total, uint16_t sample) {
-            uint16_t sampleChannel = sample >> 12;
-            uint16_t sampleValue = sample & 0xFFF;
-            if ( sampleChannel != channel ) {
-                TRACE( "Data found for unknown channel: %d", sampleChannel );
-            }
-            return total + sampleValue;
-        });
-    }
-    return total / (adc::BufferSize*N_BUFFERS);
+// Averages ADC readings of a channel until the standard error of the mean is below
+// MaxStandardError or MaxReadings are taken. Steady readings stop after MinReadings.
+static const uint32_t MinReadings = 32;
+static const uint32_t MaxReadings = 1024;
+static const uint32_t InverseMaxStandardError = 4;       // 1/4 of an ADC step
+
+struct AverageReading {
+    uint16_t value;
+    uint32_t readings;
+};
+
+static void configureRawRead( adc1_channel_t channel ) {
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(channel, ADC_ATTEN_DB_0);
 }
 
-static void interpolate( uint16_t* table, uint16_t valueAfter ) {
-    uint16_t valueBefore = *table;
-    uint16_t diff = valueAfter - valueBefore;
-    if ( valueAfter < valueBefore ) {
-        TRACE("Read value is lower than reading of previous voltage: %u > %u", 
-                valueBefore, valueAfter);
-    }
-    for( int i=1; i<16; ++i ) {
-       table[i] = valueBefore + ((diff * i) >> 4);
+static AverageReading averageRawRead( adc1_channel_t channel ) {
+    uint32_t n = 0;
+    uint64_t sum = 0;
+    uint64_t squaresSum = 0;
+    while( n < MaxReadings ) {
+        for( uint32_t i=0; i<MinReadings; ++i ) {
+            uint32_t value = adc1_get_raw(channel);
+            sum += value;
+            squaresSum += value * value;
+        }
+        n += MinReadings;
+
+        // Variance of the mean: (n*squaresSum - sum^2) / n^3
+        static const uint64_t Factor = InverseMaxStandardError * InverseMaxStandardError;
+        if ( (n*squaresSum - sum*sum) * Factor <= uint64_t(n) * n * n ) {
+            break;
+        }
     }
+
+    AverageReading ret;
+    ret.value = (sum + n/2) / n;
+    ret.readings = n;
+    return ret;
 }
 
-static void buildDacToAdcMapping( dac_channel_t dac, adc1_channel_t adc, uint16_t* table ) {
-    dac_output_enable(dac);
-    adc::ADC_IMPL::start( nonstd::span<const adc1_channel_t>( &adc, 1 ) );
+static const size_t SweepSize = 256;
+
+// The DAC is read every CoarseStep codes. Intervals are bisected while the reading in the
+// middle is further than MaxInterpolationError from the line between their ends, so points
+// are dense only where the ADC is not linear
+static const uint8_t CoarseStep = 16;
+static const uint16_t MaxInterpolationError = 4;
+
+class DacSweep {
+public:
+    DacSweep( dac_channel_t dac, adc1_channel_t adc, SweepPoint* points ): 
+        m_dac(dac), m_adc(adc), m_points(points), m_size(0), m_readings(0) {}
+
+    size_t run() {
+        dac_output_enable(m_dac);
+        configureRawRead(m_adc);
+
+        uint8_t first = 0;
+        uint16_t firstValue = measure(first);
+        add( first, firstValue );
+        while( first < 255 ) {
+            uint8_t last = std::min( first + CoarseStep, 255 );
+            uint16_t lastValue = measure(last);
+            refine( first, firstValue, last, lastValue );
+            add( last, lastValue );
+            first = last;
+            firstValue = lastValue;
+        }
 
-    for( int i=0; i<256; ++i ) {
-        dac_output_voltage(dac, i);
+        dac_output_voltage(m_dac, 0);
+        return m_size;
+    }
+
+    uint32_t readings() const {
+        return m_readings;
+    }
+
+private:
+    uint16_t measure( uint8_t code ) {
+        dac_output_voltage(m_dac, code);
         vTaskDelay( 1 / portTICK_PERIOD_MS );
+        AverageReading reading = averageRawRead(m_adc);
+        m_readings += reading.readings;
+        return reading.value;
+    }
 
-        table[16] = rawRead(adc);
-        interpolate( table, table[16] );
+    void add( uint8_t code, uint16_t value ) {
+        m_points[m_size].dac = code * DacSubsteps;
+        m_points[m_size].adc = value;
+        ++m_size;
+    }
 
-        table += 16;
+    // Adds the points needed between first and last, in order
+    void refine( uint8_t first, uint16_t firstValue, uint8_t last, uint16_t lastValue ) {
+        if ( last - first < 2 ) {
+            return;
+        }
+        uint8_t middle = (first + last) / 2;
+        uint16_t middleValue = measure(middle);
+        int32_t expected = firstValue + 
+                (int32_t(lastValue - firstValue) * (middle - first)) / (last - first);
+        bool linear = abs( int32_t(middleValue) - expected ) <= MaxInterpolationError;
+
+        if ( !linear ) {
+            refine( first, firstValue, middle, middleValue );
+        }
+        add( middle, middleValue );
+        if ( !linear ) {
+            refine( middle, middleValue, last, lastValue );
+        }
     }
 
-    adc::ADC_IMPL::stop();
-    interpolate( table, 4096 );
-    dac_output_voltage(DAC_CHANNEL_1, 0);
-}
+private:
+    dac_channel_t m_dac;
+    adc1_channel_t m_adc;
+    SweepPoint* m_points;
+    size_t m_size;
+    uint32_t m_readings;
+};
 
 __attribute__((used))
-static void traceTable( const uint16_t* table ) {
-    for (int i=0; i<4096; i+=16) {
-        Serial.printf( "%04u:", i );
-        for( int j=i; j<i+16; ++j ) {
-            Serial.printf(" %05u", table[j]);
+static void traceModel( const _::AdcSegment* model ) {
+    for (size_t i=0; i<_::AdcSegments; i+=8) {
+        Serial.printf( "%04u:", i * _::AdcSegmentSize );
+        for( size_t j=i; j<i+8; ++j ) {
+            Serial.printf(" %05u/%+04d", model[j].base, model[j].delta);
         }
         Serial.printf( "\n" );
     }
 }
 
-static void buildAdcToDacMapping( const uint16_t* dacToAdc, uint16_t* adcToDac ) {
-  /*  uint16_t voltage = 0;
-    uint16_t diff = 9999;
-    for( int i=0; i<4096; ++i ) {
-        uint16_t newDiff = 0;
-        while( (voltage<4096) && (newDiff<=diff) ) {
-            newDiff = abs( i - readings[voltage++] );
-        }
-        adcLut[i] = voltage;
-    } */
-
-    for( int i=0; i<4096; ++i ) {
-        uint16_t voltage = 0;
-        uint16_t diff = 9999;
-        for( int j=0; j<4096; ++j ) {
-            uint16_t newDiff = abs( i - dacToAdc[j] );
-            if ( newDiff<diff ) {
-                diff = newDiff;
-                voltage = j;
-            }
-        }
-        adcToDac[i] = voltage;
-    } 
-}
-
-
 // If you use mV as unit as the esp-idf esp_adc_cal_raw_to_voltage function does, you will loose
 // more than 2 bits of resolution. With mV as unit, we have 900 possible values (>10 bits) in the
 // range of 100mV to 1V.
 // To avoid this loss of resolution, we use tenths of mV as unit. We really can't get that
 // resolution (we have only 12 bits) but it is more human redeable to apply a factor of 10 than 
 // a factor of 4 and we have enough room in 32 bits for overflows to occur.
-static void dacValuesToVoltage( uint16_t* table, 
+static void dacValuesToVoltage( uint16_t* knots, 
                                 adc1_channel_t adcHighRefChannel,
                                 adc1_channel_t adcLowRefChannel ) {
     static const uint16_t HighRefVoltage = 9590;         // In tenths of mV
     static const uint16_t LowRefVoltage = 1299;          // In tenths of mV
 
     ets_delay_us( 100 );
-    adc::ADC_IMPL::start( nonstd::span<const adc1_channel_t>( &adcHighRefChannel, 1 ) );
-    uint16_t highRefAdcValue = rawRead(adcHighRefChannel);
-    adc::ADC_IMPL::stop();
-    adc::ADC_IMPL::start( nonstd::span<const adc1_channel_t>( &adcLowRefChannel, 1 ) );
-    uint16_t lowRefAdcValue = rawRead(adcLowRefChannel);
-    adc::ADC_IMPL::stop();
+    configureRawRead(adcHighRefChannel);
+    uint16_t highRefAdcValue = averageRawRead(adcHighRefChannel).value;
+    configureRawRead(adcLowRefChannel);
+    uint16_t lowRefAdcValue = averageRawRead(adcLowRefChannel).value;
 
-    uint16_t highRefDacValue = table[highRefAdcValue];
-    uint16_t lowRefDacValue = table[lowRefAdcValue];
+    uint16_t highRefDacValue = evaluateKnots( knots, highRefAdcValue );
+    uint16_t lowRefDacValue = evaluateKnots( knots, lowRefAdcValue );
 
     uint32_t deltaX = highRefDacValue - lowRefDacValue;
     const static uint32_t deltaY = HighRefVoltage - LowRefVoltage;
@@ -179,33 +221,85 @@ static void dacValuesToVoltage( uint16_t* table,
 
     TRACE("DAC offset: %.1f mV", dacOffsetVoltage / 10.0);
     
-    for ( int i=0; i<4096; ++i ) {
-        uint32_t v = table[i];
-        table[i] = (((v * deltaY) + (deltaX>>1)) / deltaX) + dacOffsetVoltage;
+    for ( size_t k=0; k<=_::AdcSegments; ++k ) {
+        uint32_t v = knots[k];
+        knots[k] = (((v * deltaY) + (deltaX>>1)) / deltaX) + dacOffsetVoltage;
+    }
+}
+
+// The model is stored with a format version and a checksum
+static const char* AdcModelStore = "wattmeter";
+static const char* AdcModelKey = "adcModel";
+static const uint32_t AdcModelVersion = 2;
+
+struct StoredAdcModel {
+    uint32_t version;
+    uint32_t crc;
+    _::AdcSegment segments[_::AdcSegments];
+};
+
+static void saveAdcCharacterization() {
+    StoredAdcModel stored;
+    stored.version = AdcModelVersion;
+    std::copy( _::adcModel, _::adcModel + _::AdcSegments, stored.segments );
+    stored.crc = crc32_le( 0, reinterpret_cast<const uint8_t*>(stored.segments), sizeof(stored.segments) );
+
+    nvs_handle handle;
+    if ( nvs_open(AdcModelStore, NVS_READWRITE, &handle) != ESP_OK ) {
+        TRACE_ERROR( "ADC conversion model not saved" );
+        return;
     }
+    TRACE_ESP_ERROR_CHECK(nvs_set_blob(handle, AdcModelKey, &stored, sizeof(stored)));
+    TRACE_ESP_ERROR_CHECK(nvs_commit(handle));
+    nvs_close(handle);
+}
+
+bool loadAdcCharacterization() {
+    nvs_handle handle;
+    if ( nvs_open(AdcModelStore, NVS_READONLY, &handle) != ESP_OK ) {
+        return false;
+    }
+    StoredAdcModel stored;
+    size_t size = sizeof(stored);
+    bool loaded = (nvs_get_blob(handle, AdcModelKey, &stored, &size) == ESP_OK) && 
+                  (size == sizeof(stored)) && (stored.version == AdcModelVersion) &&
+                  (crc32_le(0, reinterpret_cast<const uint8_t*>(stored.segments), 
+                            sizeof(stored.segments)) == stored.crc);
+    nvs_close(handle);
+
+    if ( !loaded ) {
+        TRACE( "No valid ADC conversion model stored" );
+        return false;
+    }
+    std::copy( stored.segments, stored.segments + _::AdcSegments, _::adcModel );
+    _::adcModelInitialized = true;
+    TRACE( "ADC conversion model loaded" );
+    return true;
 }
 
-// Indexes are DAC values and values are the corresponding ADC value
-static uint16_t dacToAdc[4096];
 
 void characterizeAdc( dac_channel_t dac, adc1_channel_t adc, 
                     adc1_channel_t adcHighRef, adc1_channel_t adcLowRef ) {
     TRACE("Characterizing ADC voltage..."); 
 
-    buildDacToAdcMapping( dac, adc, dacToAdc );
-    TRACE("DAC value to ADC value table:"); 
- //   traceTable( dacToAdc );
-    
-    buildAdcToDacMapping( dacToAdc, adcToVoltage );
-    TRACE("ADC value to DAC value table:"); 
- //   traceTable( adcToVoltage );
+    uint64_t start = esp_timer_get_time();
+    static SweepPoint sweep[SweepSize];
+    DacSweep dacSweep( dac, adc, sweep );
+    size_t sweepSize = dacSweep.run();
+    TRACE("DAC sweep: %u points, %u readings, %u ms", sweepSize, dacSweep.readings(),
+            uint32_t((esp_timer_get_time() - start) / 1000));
 
-    dacValuesToVoltage( adcToVoltage, adcHighRef, adcLowRef );
-    TRACE("ADC value to voltage conversion table (tenths of mV):"); 
- //   traceTable( adcToVoltage );
+    uint16_t knots[_::AdcSegments+1];
+    fitDacModel( sweep, sweepSize, knots );
+    dacValuesToVoltage( knots, adcHighRef, adcLowRef );
 
-    adcToVoltageInitialized = true;
+    knotsToSegments( knots, _::adcModel );
+    TRACE("ADC value to voltage conversion model (tenths of mV):"); 
+ //   traceModel( _::adcModel );
+
+    _::adcModelInitialized = true;
+    saveAdcCharacterization();
 }
 
 
-}
\ No newline at end of file
+}
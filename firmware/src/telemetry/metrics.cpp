@@ -0,0 +1,105 @@
+#include "telemetry/metrics.h"
+#include "telemetry/telemetry.h"
+#include "util/trace.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include <array>
+
+namespace telemetry {
+
+static const size_t MaxSources = 4;
+
+static std::array<MetricsSource, MaxSources> sources;
+static size_t nSources = 0;
+
+
+void addMetricsSource( MetricsSource source ) {
+    if ( nSources == MaxSources ) {
+        TRACE_ERROR( "Too many metrics sources" );
+        return;
+    }
+    sources[nSources++] = source;
+}
+
+
+static void adcMetrics( MetricsWriter& metrics ) {
+    adc::Stats adc = adcStats();
+
+    metrics.family( "wattmeter_adc_buffers_produced_total", "counter", "ADC buffers filled" );
+    metrics.sample( "wattmeter_adc_buffers_produced_total", NULL, adc.produced );
+    metrics.family( "wattmeter_adc_buffers_consumed_total", "counter", "ADC buffers read" );
+    metrics.sample( "wattmeter_adc_buffers_consumed_total", NULL, adc.consumed );
+    metrics.family( "wattmeter_adc_buffers_dropped_total", "counter", 
+                    "ADC buffers overwritten before being read" );
+    metrics.sample( "wattmeter_adc_buffers_dropped_total", NULL, adc.dropped );
+    metrics.family( "wattmeter_adc_isr_max_microseconds", "gauge", "Max acquisition ISR duration" );
+    metrics.sample( "wattmeter_adc_isr_max_microseconds", NULL, adc.isrMaxDuration );
+}
+
+
+static void pipelineMetrics( MetricsWriter& metrics ) {
+    char labels[32];
+
+    metrics.family( "wattmeter_pipeline_latency_microseconds", "histogram", 
+                    "Time from the first sample of a buffer until a stage has processed it" );
+    for( size_t stage = 0; stage < StagesSize; ++stage ) {
+        snprintf( labels, sizeof(labels), "stage=\"%s\"", stageName(static_cast<Stage>(stage)) );
+        metrics.histogram( "wattmeter_pipeline_latency_microseconds", labels, 
+                            latency(static_cast<Stage>(stage)) );
+    }
+
+    metrics.family( "wattmeter_queue_depth", "gauge", "Blocks waiting in a pipeline queue" );
+    for( size_t i = 0; i < queuesSize(); ++i ) {
+        snprintf( labels, sizeof(labels), "queue=\"%s\"", queueName(i) );
+        metrics.sample( "wattmeter_queue_depth", labels, 
+                        static_cast<uint32_t>(queueStats(i).size) );
+    }
+    metrics.family( "wattmeter_queue_capacity", "gauge", "Blocks a pipeline queue can hold" );
+    for( size_t i = 0; i < queuesSize(); ++i ) {
+        snprintf( labels, sizeof(labels), "queue=\"%s\"", queueName(i) );
+        metrics.sample( "wattmeter_queue_capacity", labels, 
+                        static_cast<uint32_t>(queueStats(i).capacity) );
+    }
+    metrics.family( "wattmeter_queue_dropped_total", "counter", 
+                    "Blocks discarded because a pipeline queue was full" );
+    for( size_t i = 0; i < queuesSize(); ++i ) {
+        snprintf( labels, sizeof(labels), "queue=\"%s\"", queueName(i) );
+        metrics.sample( "wattmeter_queue_dropped_total", labels, queueStats(i).dropped );
+    }
+}
+
+
+static void systemMetrics( MetricsWriter& metrics ) {
+    metrics.family( "wattmeter_heap_free_bytes", "gauge", "Free heap" );
+    metrics.sample( "wattmeter_heap_free_bytes", NULL, esp_get_free_heap_size() );
+    metrics.family( "wattmeter_heap_min_free_bytes", "gauge", "Lowest free heap since boot" );
+    metrics.sample( "wattmeter_heap_min_free_bytes", NULL, esp_get_minimum_free_heap_size() );
+    metrics.family( "wattmeter_heap_largest_free_block_bytes", "gauge", "Largest free heap block" );
+    metrics.sample( "wattmeter_heap_largest_free_block_bytes", NULL, 
+                    static_cast<uint32_t>(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)) );
+
+    char labels[40];
+    metrics.family( "wattmeter_task_stack_free_bytes", "gauge", 
+                    "Lowest free stack of a task since it was created" );
+    for( size_t i = 0; i < tasksSize(); ++i ) {
+        snprintf( labels, sizeof(labels), "task=\"%s\"", taskName(i) );
+        metrics.sample( "wattmeter_task_stack_free_bytes", labels, taskStackHighWaterMark(i) );
+    }
+}
+
+
+size_t renderMetrics( char* buffer, size_t size ) {
+    TextWriter writer( buffer, size );
+    MetricsWriter metrics( writer );
+
+    adcMetrics( metrics );
+    pipelineMetrics( metrics );
+    systemMetrics( metrics );
+    for( size_t i = 0; i < nSources; ++i ) {
+        sources[i]( metrics );
+    }
+
+    return writer.length();
+}
+
+}
@@ -0,0 +1,131 @@
+#include "telemetry/telemetry.h"
+#include "meter/sampler.h"
+#include "util/trace.h"
+#include "util/textwriter.h"
+#include "esp_timer.h"
+#include <array>
+
+namespace telemetry {
+
+static const size_t MaxQueues = 4;
+static const size_t MaxTasks = 8;
+
+static std::array<LatencyHistogram, StagesSize> latencies;
+static std::array<std::pair<const char*, QueueProbe>, MaxQueues> queues;
+static size_t nQueues = 0;
+static std::array<std::pair<const char*, TaskHandle_t>, MaxTasks> tasks;
+static size_t nTasks = 0;
+
+
+void recordLatency( Stage stage, uint64_t bufferTime ) {
+    latencies[stage].add( esp_timer_get_time() - bufferTime );
+}
+
+const LatencyHistogram& latency( Stage stage ) {
+    return latencies[stage];
+}
+
+const char* stageName( Stage stage ) {
+    static const char* names[StagesSize] = { "read", "calculation" };
+    return names[stage];
+}
+
+
+adc::Stats adcStats() {
+    return adc::ADC_IMPL::stats();
+}
+
+
+void addQueueProbe( const char* name, QueueProbe probe ) {
+    if ( nQueues == MaxQueues ) {
+        TRACE_ERROR( "Too many queues watched. %s ignored", name );
+        return;
+    }
+    queues[nQueues++] = std::make_pair( name, probe );
+}
+
+size_t queuesSize() {
+    return nQueues;
+}
+
+const char* queueName( size_t index ) {
+    return queues[index].first;
+}
+
+QueueStats queueStats( size_t index ) {
+    return queues[index].second();
+}
+
+
+void watchTask( const char* name, TaskHandle_t task ) {
+    if ( nTasks == MaxTasks ) {
+        TRACE_ERROR( "Too many tasks watched. %s ignored", name );
+        return;
+    }
+    tasks[nTasks++] = std::make_pair( name, task );
+}
+
+size_t tasksSize() {
+    return nTasks;
+}
+
+const char* taskName( size_t index ) {
+    return tasks[index].first;
+}
+
+uint32_t taskStackHighWaterMark( size_t index ) {
+    return uxTaskGetStackHighWaterMark( tasks[index].second );
+}
+
+
+size_t formatJson( char* buffer, size_t size ) {
+    TextWriter writer( buffer, size );
+
+    adc::Stats adc = adcStats();
+    writer.printf( "{\"adc\":{\"produced\":%u,\"consumed\":%u,\"dropped\":%u,\"isrMaxUs\":%u},",
+                    adc.produced, adc.consumed, adc.dropped, adc.isrMaxDuration );
+
+    writer.printf( "\"latency\":{" );
+    for( size_t stage = 0; stage < StagesSize; ++stage ) {
+        const LatencyHistogram& histogram = latencies[stage];
+        writer.printf( "%s\"%s\":{\"count\":%u,\"maxUs\":%u,\"buckets\":[", 
+                        (stage == 0) ? "" : ",", stageName(static_cast<Stage>(stage)),
+                        histogram.count(), histogram.max() );
+        for( size_t i = 0; i < LatencyHistogram::Size; ++i ) {
+            writer.printf( "%s%u", (i == 0) ? "" : ",", histogram[i] );
+        }
+        writer.printf( "]}" );
+    }
+    writer.printf( "}," );
+
+    writer.printf( "\"queues\":{" );
+    for( size_t i = 0; i < nQueues; ++i ) {
+        QueueStats stats = queueStats(i);
+        writer.printf( "%s\"%s\":{\"size\":%u,\"capacity\":%u,\"dropped\":%u}",
+                        (i == 0) ? "" : ",", queueName(i), 
+                        stats.size, stats.capacity, stats.dropped );
+    }
+    writer.printf( "}}" );
+
+    return writer.length();
+}
+
+
+void trace() {
+    adc::Stats adc = adcStats();
+    TRACE( "ADC buffers: produced %u, consumed %u, dropped %u. ISR max: %u us",
+            adc.produced, adc.consumed, adc.dropped, adc.isrMaxDuration );
+
+    for( size_t stage = 0; stage < StagesSize; ++stage ) {
+        const LatencyHistogram& histogram = latencies[stage];
+        TRACE( "Latency %s: max %u us", stageName(static_cast<Stage>(stage)), histogram.max() );
+    }
+
+    for( size_t i = 0; i < nQueues; ++i ) {
+        QueueStats stats = queueStats(i);
+        TRACE( "Queue %s: %u/%u, dropped %u", queueName(i), 
+                stats.size, stats.capacity, stats.dropped );
+    }
+}
+
+}
@@ -0,0 +1,41 @@
+#include "util/extram.h"
+#include "esp_heap_caps.h"
+#include "Arduino.h"
+
+namespace extram {
+
+static const uint32_t Caps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+
+
+bool available() {
+    return psramFound();
+}
+
+
+size_t largestFreeBlock() {
+    size_t largest = available() ? heap_caps_get_largest_free_block( Caps ) : 0;
+    return (largest > Alignment) ? (largest - Alignment) : 0;
+}
+
+
+// Blocks are allocated with room for the alignment. The start of the block is kept just
+// before the buffer returned (heap blocks are aligned to at least 4 bytes)
+void* allocate( size_t size ) {
+    uint8_t* block = available() ? 
+            static_cast<uint8_t*>( heap_caps_malloc( size + Alignment, Caps ) ) : NULL;
+    if ( block == NULL ) {
+        return NULL;
+    }
+    uint8_t* buffer = block + Alignment - (reinterpret_cast<uintptr_t>(block) % Alignment);
+    reinterpret_cast<void**>(buffer)[-1] = block;
+    return buffer;
+}
+
+
+void release( void* buffer ) {
+    if ( buffer != NULL ) {
+        heap_caps_free( reinterpret_cast<void**>(buffer)[-1] );
+    }
+}
+
+}
@@ -0,0 +1,159 @@
+#include "util/tracering.h"
+#include "util/trace.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/portmacro.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace trace {
+
+static const size_t RingSize = 256;                 // Must be a power of 2
+static const size_t MaxEventLength = 96;
+static const TickType_t EventsTaskPeriod = 100 / portTICK_PERIOD_MS;
+
+static const char* formats[events::Size] = {
+#define TRACE_EVENT_FORMAT(id, format) format,
+    TRACE_EVENTS(TRACE_EVENT_FORMAT)
+#undef TRACE_EVENT_FORMAT
+};
+
+static Event ring[RingSize];
+static uint32_t head = 0;               // Free running counters. Index is counter % RingSize
+static uint32_t tail = 0;
+static uint32_t lost = 0;
+static portMUX_TYPE ringLock = portMUX_INITIALIZER_UNLOCKED;
+
+
+void IRAM_ATTR event( events::Id id, uint32_t arg0, uint32_t arg1, uint32_t arg2 ) {
+    uint32_t time = esp_timer_get_time();
+
+    portENTER_CRITICAL_ISR( &ringLock );
+    if ( (tail - head) == RingSize ) {
+        ++head;
+        ++lost;
+    }
+    Event& event = ring[tail & (RingSize-1)];
+    event.time = time;
+    event.id = id;
+    event.core = xPortGetCoreID();
+    event.args[0] = arg0;
+    event.args[1] = arg1;
+    event.args[2] = arg2;
+    ++tail;
+    portEXIT_CRITICAL_ISR( &ringLock );
+}
+
+
+static bool peekEvent( Event& event, uint32_t& position ) {
+    portENTER_CRITICAL( &ringLock );
+    bool ret = (head != tail);
+    if ( ret ) {
+        event = ring[head & (RingSize-1)];
+        position = head;
+    }
+    portEXIT_CRITICAL( &ringLock );
+    return ret;
+}
+
+
+static void popEvent( uint32_t position ) {
+    portENTER_CRITICAL( &ringLock );
+    // The event could have been overwritten meanwhile
+    if ( head == position ) {
+        ++head;
+    }
+    portEXIT_CRITICAL( &ringLock );
+}
+
+
+bool nextEvent( Event& event ) {
+    uint32_t position;
+    if ( !peekEvent( event, position ) ) {
+        return false;
+    }
+    popEvent( position );
+    return true;
+}
+
+
+bool pendingEvents() {
+    portENTER_CRITICAL( &ringLock );
+    bool ret = (head != tail);
+    portEXIT_CRITICAL( &ringLock );
+    return ret;
+}
+
+
+uint32_t lostEvents() {
+    return lost;
+}
+
+
+int formatEvent( const Event& event, char* buffer, size_t size ) {
+    int prefixLength = snprintf( buffer, size, "%10u [%u] ", event.time, event.core );
+    if ( (prefixLength < 0) || (static_cast<size_t>(prefixLength) >= size) ) {
+        return prefixLength;
+    }
+
+    const char* format = (event.id < events::Size) ? formats[event.id] : "Unknown event %u";
+    uint32_t arg0 = (event.id < events::Size) ? event.args[0] : event.id;
+    int length = snprintf( buffer + prefixLength, size - prefixLength, format, 
+                            arg0, event.args[1], event.args[2] );
+    return (length < 0) ? length : (prefixLength + length);
+}
+
+
+size_t formatEvents( char* buffer, size_t size ) {
+    size_t written = 0;
+    Event event;
+    uint32_t position;
+    char line[MaxEventLength];
+    while( peekEvent( event, position ) ) {
+        int length = formatEvent( event, line, sizeof(line) );
+        if ( length < 0 ) {
+            popEvent( position );
+            continue;
+        }
+        size_t lineLength = std::min<size_t>( length, sizeof(line) - 1 );
+        if ( written + lineLength + 1 > size ) {
+            break;
+        }
+        memcpy( buffer + written, line, lineLength );
+        written += lineLength;
+        buffer[written++] = '\n';
+        popEvent( position );
+    }
+    return written;
+}
+
+
+static void eventsTask( void* ) {
+    uint32_t lastLost = 0;
+    Event event;
+    char line[MaxEventLength];
+    while( true ) {
+        while( nextEvent( event ) ) {
+            formatEvent( event, line, sizeof(line) );
+            Serial.printf( "Event %s\n", line );
+        }
+
+        uint32_t currentLost = lost;
+        if ( currentLost != lastLost ) {
+            Serial.printf( "Event %u events lost\n", currentLost - lastLost );
+            lastLost = currentLost;
+        }
+
+        vTaskDelay( EventsTaskPeriod );
+    }
+}
+
+
+void startEventsTask() {
+    TaskHandle_t task;
+    xTaskCreatePinnedToCore( eventsTask, "traceEvents", 2048, NULL, tskIDLE_PRIORITY, &task, 0 );
+}
+
+}
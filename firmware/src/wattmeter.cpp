@@ -11,7 +11,14 @@
 #include "web/server.h"
 #include "meter/sampledmeter.h"
 #include "meter/calculatedmeter.h"
+#include "meter/capture.h"
+#include "meter/burst.h"
+#include "history/flashlog.h"
+#include "telemetry/telemetry.h"
+#include "telemetry/metrics.h"
 #include "util/trace.h"
+#include "util/tracering.h"
+#include "util/blockqueue.h"
 #include <algorithm>
 #include <Arduino.h>
 
@@ -20,10 +27,15 @@
 #define MAIN
 
 static const char* hostname="wattmeter";
-static const adc1_channel_t ZERO_ADC_CHANNEL = ADC1_CHANNEL_6;
+static const adc1_channel_t ZERO_ADC_CHANNEL = meter::SampleBasedMeter::ZeroChannel;
+static const int64_t StatsTraceInterval = 60 * 1000000LL;        // In us
+static const TickType_t BurstRetryDelay = 5 / portTICK_PERIOD_MS;
 
 meter::SampleBasedMeter sampledMeter;
 meter::CalculatorBasedMeter calculatedMeter;
+meter::Capture capture( meter::SampleBasedMeter::SequenceSize );
+meter::Burst burst( meter::SampleBasedMeter::SequenceSize );
+history::FlashLog flashLog;
 
 web::Server webServer(8080);
 io::Display display;
@@ -56,32 +68,177 @@ void showInfo( void* ) {
 }
 
 
-void readSamples( void* ) {
-    meter::SampleBasedMeter::Measures sampledMeasures;
+// Samples pipeline:
+//  - acquireSamples (core 1): reads ADC buffers, groups and scales them, and changes ranges
+//      from the peaks of each block. It never waits for other stages, so a slow stage can't
+//      delay adc::readData and make ADC buffers to be lost. When a stage queue is full, the
+//      block is discarded for this stage.
+//  - calculateMeasures (core 1): computes RMS, power, frequency...
+//  - sendSamples (core 0, with WiFi stack): encodes and sends blocks to WebSocket clients.
+static const size_t CalculationQueueSize = 4;
+static const size_t NetworkQueueSize = 8;
 
+BlockQueue<meter::SampleBasedMeter::Measures, CalculationQueueSize> calculationQueue;
+BlockQueue<meter::SampleBasedMeter::Measures, NetworkQueueSize> networkQueue;
+
+
+void acquireSamples( void* ) {
     sampledMeter.start();
-    std::pair<float, float> scaleFactors = sampledMeter.scaleFactors();
-    calculatedMeter.scaleFactors( scaleFactors );
 
     while(running) {
-        uint64_t time = sampledMeter.read( sampledMeasures );
+        meter::SampleBasedMeter::Measures& sampledMeasures = calculationQueue.back();
+        sampledMeter.read( sampledMeasures );
+        telemetry::recordLatency( telemetry::ReadStage, sampledMeasures.time() );
+        capture.check( sampledMeasures, sampledMeter.overflow() );
 //TRACE_TIME_INTERVAL_BEGIN(readOp);
-        webServer.send( time, scaleFactors, sampledMeasures );
-        if ( calculatedMeter.process( time, sampledMeasures ) ) {
-            if ( sampledMeter.autoRange() ) {
-                scaleFactors = sampledMeter.scaleFactors();
-                calculatedMeter.scaleFactors( scaleFactors );
-            }
+        // Grouped values aren't streamed during a burst, leaving the link to it
+        if ( !burst.active() ) {
+            networkQueue.back() = sampledMeasures;
+            networkQueue.push();
         }
+        calculationQueue.push();
+
+        sampledMeter.autoRange();
 //TRACE_TIME_INTERVAL_END(readOp);  
     }
     sampledMeter.stop();
 
-    TRACE( "readSamples task finished" );
+    TRACE( "acquireSamples task finished" );
+    vTaskDelete(NULL);
+}
+
+
+void calculateMeasures( void* ) {
+    while(running) {
+        if ( !calculationQueue.wait( 100 / portTICK_PERIOD_MS ) ) {
+            continue;
+        }
+        const meter::SampleBasedMeter::Measures& sampledMeasures = calculationQueue.front();
+        if ( calculatedMeter.process( sampledMeasures ) ) {
+            meter::CalculatedMeasures measures;
+            if ( calculatedMeter.last( measures ) ) {
+                flashLog.add( measures );
+            }
+        }
+        telemetry::recordLatency( telemetry::CalculationStage, sampledMeasures.time() );
+        calculationQueue.pop();
+    }
+
+    TRACE( "calculateMeasures task finished" );
+    vTaskDelete(NULL);
+}
+
+
+void sendSamples( void* ) {
+    while(running) {
+        if ( burst.active() || !burst.queue().empty() ) {
+            if ( burst.queue().wait( 100 / portTICK_PERIOD_MS ) && !webServer.sendBurst() ) {
+                vTaskDelay( BurstRetryDelay );
+            }
+            continue;
+        }
+
+        if ( !networkQueue.wait( 100 / portTICK_PERIOD_MS ) ) {
+            continue;
+        }
+        webServer.send( networkQueue.front() );
+        networkQueue.pop();
+    }
+
+    TRACE( "sendSamples task finished" );
     vTaskDelete(NULL);
 }
 
-TaskHandle_t readSamplesTask;
+static void variableMetrics( telemetry::MetricsWriter& metrics, const char* name, 
+                            const meter::VariableMeasure& measure ) {
+    metrics.sample( name, "stat=\"rms\"", measure.rms() );
+    metrics.sample( name, "stat=\"mean\"", measure.mean() );
+    metrics.sample( name, "stat=\"min\"", measure.min() );
+    metrics.sample( name, "stat=\"max\"", measure.max() );
+}
+
+
+static uint32_t qualityFlag( const meter::CalculatedMeasures& measures, uint8_t flag ) {
+    return (measures.quality() & flag) ? 1 : 0;
+}
+
+
+void meterMetrics( telemetry::MetricsWriter& metrics ) {
+    meter::CalculatedMeasures measures;
+    if ( calculatedMeter.last( measures ) ) {
+        metrics.family( "wattmeter_voltage_volts", "gauge", "Voltage of last second" );
+        variableMetrics( metrics, "wattmeter_voltage_volts", measures.voltage() );
+        metrics.family( "wattmeter_current_amperes", "gauge", "Current of last second" );
+        variableMetrics( metrics, "wattmeter_current_amperes", measures.current() );
+
+        const meter::PowerMeasure& power = measures.power();
+        metrics.family( "wattmeter_power_active_watts", "gauge", "Active power" );
+        metrics.sample( "wattmeter_power_active_watts", NULL, power.active() );
+        metrics.family( "wattmeter_power_apparent_voltamperes", "gauge", "Apparent power" );
+        metrics.sample( "wattmeter_power_apparent_voltamperes", NULL, power.apparent() );
+        metrics.family( "wattmeter_power_reactive_var", "gauge", "Reactive power" );
+        metrics.sample( "wattmeter_power_reactive_var", NULL, power.reactive() );
+        metrics.family( "wattmeter_power_factor", "gauge", "Power factor" );
+        metrics.sample( "wattmeter_power_factor", NULL, power.factor() );
+
+        metrics.family( "wattmeter_signal_frequency_hertz", "gauge", "Signal frequency. 0 for DC" );
+        metrics.sample( "wattmeter_signal_frequency_hertz", NULL, measures.signalFrequency() / 100.0 );
+        metrics.family( "wattmeter_sample_rate_hertz", "gauge", "ADC sample rate" );
+        metrics.sample( "wattmeter_sample_rate_hertz", NULL, measures.sampleRate() );
+        metrics.family( "wattmeter_zero_drift_volts", "gauge", 
+                        "Drift of the zero reference since calibration" );
+        metrics.sample( "wattmeter_zero_drift_volts", NULL, sampledMeter.zeroDrift() / 10000.0 );
+        metrics.family( "wattmeter_measures_quality", "gauge", 
+                        "1 if some values of last second were affected" );
+        metrics.sample( "wattmeter_measures_quality", "flag=\"clipped\"", 
+                        qualityFlag( measures, meter::MeasuresBlock::Clipped ) );
+        metrics.sample( "wattmeter_measures_quality", "flag=\"range_changed\"", 
+                        qualityFlag( measures, meter::MeasuresBlock::RangeChanged ) );
+        metrics.sample( "wattmeter_measures_quality", "flag=\"settling\"", 
+                        qualityFlag( measures, meter::MeasuresBlock::Settling ) );
+        metrics.sample( "wattmeter_measures_quality", "flag=\"unknown_channel\"", 
+                        qualityFlag( measures, meter::MeasuresBlock::UnknownChannel ) );
+
+        const meter::EnergyMeasure& energy = measures.energy();
+        metrics.family( "wattmeter_energy_active_watthours_total", "counter", 
+                        "Active energy since boot" );
+        metrics.sample( "wattmeter_energy_active_watthours_total", NULL, energy.active() );
+        metrics.family( "wattmeter_energy_apparent_voltamperehours_total", "counter", 
+                        "Apparent energy since boot" );
+        metrics.sample( "wattmeter_energy_apparent_voltamperehours_total", NULL, energy.apparent() );
+    }
+
+    metrics.family( "wattmeter_range_active", "gauge", "Active range index" );
+    metrics.sample( "wattmeter_range_active", "meter=\"voltage\"", 
+                    static_cast<uint32_t>(sampledMeter.voltageMeter().activeRange()) );
+    metrics.sample( "wattmeter_range_active", "meter=\"current\"", 
+                    static_cast<uint32_t>(sampledMeter.currentMeter().activeRange()) );
+    metrics.family( "wattmeter_range_auto", "gauge", "1 if auto range is enabled" );
+    metrics.sample( "wattmeter_range_auto", "meter=\"voltage\"", 
+                    static_cast<uint32_t>(sampledMeter.voltageMeter().autoRange()) );
+    metrics.sample( "wattmeter_range_auto", "meter=\"current\"", 
+                    static_cast<uint32_t>(sampledMeter.currentMeter().autoRange()) );
+
+    metrics.family( "wattmeter_history_energy_active_watthours_total", "counter", 
+                    "Active energy since the history log was created" );
+    metrics.sample( "wattmeter_history_energy_active_watthours_total", NULL, flashLog.activeEnergy() );
+    metrics.family( "wattmeter_history_energy_apparent_voltamperehours_total", "counter", 
+                    "Apparent energy since the history log was created" );
+    metrics.sample( "wattmeter_history_energy_apparent_voltamperehours_total", NULL, 
+                    flashLog.apparentEnergy() );
+    metrics.family( "wattmeter_history_dropped_total", "counter", 
+                    "Records not written to the history log" );
+    metrics.sample( "wattmeter_history_dropped_total", NULL, flashLog.dropped() );
+    metrics.family( "wattmeter_history_flash_stall_max_seconds", "gauge", 
+                    "Longest history flash erase or write, with the cache of both cores disabled" );
+    metrics.sample( "wattmeter_history_flash_stall_max_seconds", NULL, flashLog.maxFlashStall() / 1e6 );
+    metrics.family( "wattmeter_history_flash_overruns_total", "counter", 
+                    "History flash operations longer than the ADC DMA buffers" );
+    metrics.sample( "wattmeter_history_flash_overruns_total", NULL, flashLog.flashOverruns() );
+}
+
+
+TaskHandle_t acquireSamplesTask;
 void setup()
 {
 	Serial.begin(115200);
@@ -103,18 +260,47 @@ void setup()
 
     commands::init();
 
+#ifdef TRACE_EVENTS_SERIAL
+    trace::startEventsTask();
+#endif
+
 #if defined(MAIN)
 	uint16_t zero = defaultZero();
     sampledMeter.init( zero );
+    flashLog.init();
 	
     delay(500);
+    telemetry::watchQueue( "calculation", calculationQueue );
+    telemetry::watchQueue( "network", networkQueue );
+    telemetry::addMetricsSource( meterMetrics );
+    telemetry::watchQueue( "burst", burst.queue() );
+    sampledMeter.setRawObserver( []( const adc::Buffer& buffer, uint64_t time ) {
+        capture.record( buffer, time );
+        burst.record( buffer, time );
+    });
+    if ( capture.init() ) {
+        webServer.serveCapture( capture );
+    }
+    webServer.serveBurst( burst );
+    webServer.serveHistory( flashLog );
     webServer.begin();
 
-    TaskHandle_t readSamplesTask;
-    xTaskCreatePinnedToCore( readSamples, "readSamples", 7168, NULL, 1, &readSamplesTask, 1 );
+    xTaskCreatePinnedToCore( acquireSamples, "acquireSamples", 7168, NULL, 3, &acquireSamplesTask, 1 );
+
+    TaskHandle_t calculateMeasuresTask;
+    xTaskCreatePinnedToCore( calculateMeasures, "calculateMeasures", 4096, NULL, 2, 
+                            &calculateMeasuresTask, 1 );
+
+    TaskHandle_t sendSamplesTask;
+    xTaskCreatePinnedToCore( sendSamples, "sendSamples", 4096, NULL, 1, &sendSamplesTask, 0 );
 
     TaskHandle_t showInfoTask;
     xTaskCreatePinnedToCore( showInfo, "showInfo", 2048, NULL, 1, &showInfoTask, 0 );
+
+    telemetry::watchTask( "acquireSamples", acquireSamplesTask );
+    telemetry::watchTask( "calculateMeasures", calculateMeasuresTask );
+    telemetry::watchTask( "sendSamples", sendSamplesTask );
+    telemetry::watchTask( "showInfo", showInfoTask );
 #else
     experiment::init();
 #endif
@@ -126,7 +312,7 @@ void loop()
 #if 0
     trace::traceTimeInterval( "loop" );
 
-    UBaseType_t uxHighWaterMark = uxTaskGetStackHighWaterMark(readSamplesTask);
+    UBaseType_t uxHighWaterMark = uxTaskGetStackHighWaterMark(acquireSamplesTask);
     printf( "Stack w: %u\n", uxHighWaterMark );
 #endif
 
@@ -140,6 +326,12 @@ void loop()
 	if ( commands::isFactorsCalibrationRequest() ) {
         sampledMeter.calibrateFactors();
 	}
+
+    static int64_t lastStatsTrace = 0;
+    if ( (esp_timer_get_time() - lastStatsTrace) > StatsTraceInterval ) {
+        telemetry::trace();
+        lastStatsTrace = esp_timer_get_time();
+    }
 #endif
 
     vTaskDelay( 10 / portTICK_PERIOD_MS );
@@ -1,4 +1,13 @@
 #include "web/server.h"
+#include "telemetry/telemetry.h"
+#include "telemetry/metrics.h"
+#include "meter/capture.h"
+#include "history/reader.h"
+#include "util/half.h"
+#include <memory>
+#include <vector>
+#include <stddef.h>
+#include "util/tracering.h"
 #include "util/trace.h"
 
 
@@ -8,49 +17,339 @@ static const size_t EncodedSamplesSize = meter::SampleBasedMeter::MeasuresSize *
 static const size_t MeasuresSentSize = 
                     sizeof(uint64_t) +      // Time
                     sizeof(float) * 2 +     // scale factors
+                    sizeof(uint32_t) +      // quality flags
                     EncodedSamplesSize;
 static const size_t MeasuresPerPacketSent = 3;
 static const size_t PacketSentSize = MeasuresSentSize * MeasuresPerPacketSent;
 
+static const size_t StatsBufferSize = 1024;
+static const size_t StatsBufferMargin = 64;     // For counters growing between formats
+static const size_t MetricsBufferSize = 8192;
+static const size_t MaxTraceResponseSize = 16384;
+
+static const size_t HistoryLineSize = 112;
+
+static const size_t CaptureHeaderSize = sizeof(uint32_t) * 4;
+static const size_t CaptureRecordSize = offsetof(meter::Capture::Record, data) + 
+                                        meter::Capture::PackedBufferSize;
+
 
 
 
 namespace web {
 
-Server::Server( uint16_t port ): m_ws( new websocket::Server(port) ), m_sendBufferPos(NULL) {
+Server::Server( uint16_t port ): m_ws( new websocket::Server(port) ), m_sendBufferPos(NULL), 
+                                m_burstSocket(NULL), m_burstClient(0), m_burst(NULL) {
 }
 
 
 Server::~Server() {
+    delete m_burstSocket;
     delete m_ws;
 }
 
 
+// Metrics are rendered into a static buffer and streamed from it, so a scrape doesn't
+// allocate memory for the content. All web callbacks run in the same task. Metrics
+// aren't rendered again while a previous response is being sent from the buffer.
+static char metricsBuffer[MetricsBufferSize];
+static size_t metricsLength = 0;
+static uint8_t metricsResponses = 0;
+
+static void sendMetrics( AsyncWebServerRequest* request ) {
+    if ( metricsResponses == 0 ) {
+        metricsLength = telemetry::renderMetrics( metricsBuffer, sizeof(metricsBuffer) );
+        if ( metricsLength >= sizeof(metricsBuffer) ) {
+            TRACE_ERROR( "Metrics truncated: %u bytes", metricsLength );
+            metricsLength = sizeof(metricsBuffer) - 1;
+        }
+    }
+    ++metricsResponses;
+    request->onDisconnect( []() {
+        --metricsResponses;
+    });
+
+    AsyncWebServerResponse* response = request->beginResponse( "text/plain; version=0.0.4", 
+            metricsLength, 
+            []( uint8_t* buffer, size_t maxLen, size_t index ) -> size_t {
+                size_t length = std::min( maxLen, metricsLength - index );
+                memcpy( buffer, metricsBuffer + index, length );
+                return length;
+            });
+    request->send( response );
+}
+
+
 void Server::begin() {
+    // Stats are formatted again in a larger buffer while they don't fit
+    m_ws->m_web.on( "/stats", HTTP_GET, []( AsyncWebServerRequest* request ) {
+        std::vector<char> buffer( StatsBufferSize );
+        size_t length;
+        while( (length = telemetry::formatJson( buffer.data(), buffer.size() )) >= buffer.size() ) {
+            buffer.resize( length + StatsBufferMargin );
+        }
+        request->send( 200, "application/json", buffer.data() );
+    });
+    m_ws->m_web.on( "/metrics", HTTP_GET, sendMetrics );
+    // Takes the events recorded since the last dump (when not written to serial).
+    // A chunk of 0 bytes ends the response, so while there is no room for a whole event
+    // the server is asked to try again later
+    m_ws->m_web.on( "/trace", HTTP_GET, []( AsyncWebServerRequest* request ) {
+        request->send( request->beginChunkedResponse( "text/plain", 
+                []( uint8_t* buffer, size_t maxLen, size_t index ) -> size_t {
+                    if ( index >= MaxTraceResponseSize ) {
+                        return 0;
+                    }
+                    size_t written = trace::formatEvents( reinterpret_cast<char*>(buffer), maxLen );
+                    return ((written == 0) && trace::pendingEvents()) ? RESPONSE_TRY_AGAIN : written;
+                }) );
+    });
     m_ws->begin();
 }
 
 
-inline void transfer( const meter::SampleBasedMeter::Measures& samples, void* buffer ) {
-	std::transform( samples.begin(), samples.end(),
-                    reinterpret_cast<std::pair<int16_t, int16_t>*>(buffer), 
-                    [](const meter::SampleBasedMeter::Measure& sample) {
-                        return std::make_pair( sample.voltage(), sample.current() );
-                    } );
-
-/*    int16_t* pos = reinterpret_cast<int16_t*>(buffer);
-	std::for_each( samples.begin(), samples.end(),
-        [&](const meter::SampleBasedMeter::Measure& sample) {
-		    *pos = sample.voltage();
-		    *(pos+1) = sample.current();
-		    pos += 2;
-	    });
-	return pos; */
+
+static const char* captureStateNames[] = { "idle", "armed", "triggered", "completed" };
+
+static size_t captureSize( const meter::Capture& capture ) {
+    return CaptureHeaderSize + capture.size() * CaptureRecordSize;
+}
+
+// Header (sample rate, buffers, samples per buffer, trigger sample as uint32) followed
+// by the records without their padding (time as uint64, channels of the sequence as
+// uint8 size and adc::MaxSequenceSize channels, and packed samples)
+static size_t fillCapture( const meter::Capture& capture, uint8_t* buffer, size_t maxLen, size_t index ) {
+    size_t written = 0;
+    if ( index < CaptureHeaderSize ) {
+        const uint32_t header[] = { adc::SampleRate, 
+                                    static_cast<uint32_t>(capture.size()), 
+                                    adc::BufferSize, 
+                                    static_cast<uint32_t>(capture.triggerSample()) };
+        written = std::min( maxLen, CaptureHeaderSize - index );
+        memcpy( buffer, reinterpret_cast<const uint8_t*>(header) + index, written );
+        index += written;
+    }
+
+    while( (written < maxLen) && (index < captureSize(capture)) ) {
+        size_t recordIndex = (index - CaptureHeaderSize) / CaptureRecordSize;
+        size_t offset = (index - CaptureHeaderSize) % CaptureRecordSize;
+        const uint8_t* source = reinterpret_cast<const uint8_t*>(&capture[recordIndex]) + offset;
+        size_t length = std::min( CaptureRecordSize - offset, maxLen - written );
+        memcpy( buffer + written, source, length );
+        written += length;
+        index += length;
+    }
+    return written;
+}
+
+
+void Server::serveCapture( meter::Capture& capture ) {
+    // Handlers match their subpaths, so /capture is registered last
+    m_ws->m_web.on( "/capture/arm", HTTP_GET, [&capture]( AsyncWebServerRequest* request ) {
+        meter::Capture::Trigger trigger = meter::Capture::ManualTrigger;
+        if ( request->hasParam("trigger") ) {
+            const String& name = request->getParam("trigger")->value();
+            trigger = meter::Capture::TriggersSize;
+            for( int i = 0; i < meter::Capture::TriggersSize; ++i ) {
+                meter::Capture::Trigger current = static_cast<meter::Capture::Trigger>(i);
+                if ( name == meter::Capture::triggerName(current) ) {
+                    trigger = current;
+                }
+            }
+        }
+        float level = request->hasParam("level") ? request->getParam("level")->value().toFloat() : 0.0;
+        long pre = request->hasParam("pre") ? request->getParam("pre")->value().toInt() : 
+                                              capture.capacity() / 4;
+        
+        if ( (pre < 0) || !capture.arm( trigger, level, pre ) ) {
+            request->send( 409, "text/plain", "Capture not armed" );
+            return;
+        }
+        request->send( 200, "text/plain", "Capture armed" );
+    });
+    m_ws->m_web.on( "/capture/trigger", HTTP_GET, [&capture]( AsyncWebServerRequest* request ) {
+        capture.trigger();
+        request->send( 200, "text/plain", "Capture triggered" );
+    });
+    m_ws->m_web.on( "/capture/cancel", HTTP_GET, [&capture]( AsyncWebServerRequest* request ) {
+        capture.cancel();
+        request->send( 200, "text/plain", "Capture cancelled" );
+    });
+    m_ws->m_web.on( "/capture/status", HTTP_GET, [&capture]( AsyncWebServerRequest* request ) {
+        char buffer[128];
+        meter::Capture::State state = capture.state();
+        bool completed = (state == meter::Capture::Completed);
+        snprintf( buffer, sizeof(buffer), 
+                "{\"state\":\"%s\",\"buffers\":%u,\"triggerSample\":%u,\"sampleRate\":%u}",
+                captureStateNames[state], 
+                completed ? capture.size() : 0, 
+                completed ? capture.triggerSample() : 0,
+                adc::SampleRate );
+        request->send( 200, "application/json", buffer );
+    });
+    m_ws->m_web.on( "/capture", HTTP_GET, [&capture]( AsyncWebServerRequest* request ) {
+        if ( capture.state() != meter::Capture::Completed ) {
+            request->send( 409, "text/plain", "Capture not completed" );
+            return;
+        }
+        request->send( request->beginResponse( "application/octet-stream", captureSize(capture), 
+                [&capture]( uint8_t* buffer, size_t maxLen, size_t index ) -> size_t {
+                    return fillCapture( capture, buffer, maxLen, index );
+                }) );
+    });
+}
+
+
+// History export state of one request. Only one batch of the log is in memory
+struct HistoryExport {
+    HistoryExport( const history::FlashLog& log, uint32_t fromSequence, bool csv ): 
+            reader(log, fromSequence), csv(csv), headerSent(false) {}
+
+    history::Reader reader;
+    bool csv;
+    bool headerSent;
+};
+
+
+static const char HistoryCsvHeader[] = 
+            "sequence,boot,uptime,voltage,current,active_power,frequency,flags,active_energy\n";
+
+static int formatHistoryLine( const history::Reader::Entry& entry, char* buffer, size_t size ) {
+    return snprintf( buffer, size, "%u,%u,%u,%.2f,%.6f,%.3f,%.2f,%u,%.4f\n", 
+                    entry.sequence, entry.boot, entry.uptime, 
+                    half::toFloat( entry.record.voltage ), 
+                    half::toFloat( entry.record.current ), 
+                    half::toFloat( entry.record.activePower ), 
+                    entry.record.frequency / 100.0, 
+                    entry.record.flags, 
+                    entry.activeEnergy );
+}
+
+
+// Writes whole entries, as many as fit. Returns 0 only at the end of the log: when
+// nothing fits the response is asked to try again with another buffer
+static size_t fillHistory( HistoryExport& state, uint8_t* buffer, size_t maxLen ) {
+    size_t written = 0;
+    if ( state.csv && !state.headerSent ) {
+        if ( maxLen < sizeof(HistoryCsvHeader) - 1 ) {
+            return RESPONSE_TRY_AGAIN;
+        }
+        memcpy( buffer, HistoryCsvHeader, sizeof(HistoryCsvHeader) - 1 );
+        written = sizeof(HistoryCsvHeader) - 1;
+        state.headerSent = true;
+    }
+
+    history::Reader::Entry entry;
+    char line[HistoryLineSize];
+    while( state.reader.peek( entry ) ) {
+        size_t length;
+        if ( state.csv ) {
+            length = std::min<size_t>( formatHistoryLine( entry, line, sizeof(line) ), sizeof(line) - 1 );
+        }
+        else {
+            length = 0;
+            memcpy( line + length, &entry.sequence, sizeof(uint32_t) * 3 );
+            length += sizeof(uint32_t) * 3;
+            memcpy( line + length, &entry.record, sizeof(entry.record) );
+            length += sizeof(entry.record);
+            memcpy( line + length, &entry.activeEnergy, sizeof(entry.activeEnergy) );
+            length += sizeof(entry.activeEnergy);
+        }
+        if ( written + length > maxLen ) {
+            break;
+        }
+        memcpy( buffer + written, line, length );
+        written += length;
+        state.reader.advance();
+    }
+    if ( (written == 0) && state.reader.peek( entry ) ) {
+        return RESPONSE_TRY_AGAIN;
+    }
+    return written;
+}
+
+
+// GET /history?format=csv|bin&from=<sector sequence>. Each binary entry has 30 bytes:
+// sequence, boot and uptime (uint32), the history::Record and the active energy (double)
+void Server::serveHistory( const history::FlashLog& log ) {
+    m_ws->m_web.on( "/history", HTTP_GET, [&log]( AsyncWebServerRequest* request ) {
+        if ( log.partition() == NULL ) {
+            request->send( 404, "text/plain", "History not available" );
+            return;
+        }
+        bool csv = !request->hasParam("format") || (request->getParam("format")->value() == "csv");
+        uint32_t fromSequence = request->hasParam("from") ? 
+                                request->getParam("from")->value().toInt() : 0;
+
+        std::shared_ptr<HistoryExport> state = std::make_shared<HistoryExport>( log, fromSequence, csv );
+        request->send( request->beginChunkedResponse( csv ? "text/csv" : "application/octet-stream", 
+                [state]( uint8_t* buffer, size_t maxLen, size_t index ) -> size_t {
+                    return fillHistory( *state, buffer, maxLen );
+                }) );
+    });
+}
+
+
+// Burst is requested by a client connected to /burst, sending the number of buffers
+// as text. Only one client is accepted at a time.
+void Server::serveBurst( meter::Burst& burst ) {
+    m_burst = &burst;
+    m_burstSocket = new AsyncWebSocket( "/burst" );
+    m_burstSocket->onEvent( [this]( AsyncWebSocket* server, AsyncWebSocketClient* client, 
+                                    AwsEventType type, void* arg, uint8_t* data, size_t len ) {
+        if ( type == WS_EVT_CONNECT ) {
+            uint32_t expected = 0;
+            if ( !m_burstClient.compare_exchange_strong( expected, client->id() ) ) {
+                TRACE( "Burst client %d rejected", client->id() );
+                client->close();
+            }
+        }
+        else if ( type == WS_EVT_DISCONNECT ) {
+            uint32_t expected = client->id();
+            if ( m_burstClient.compare_exchange_strong( expected, 0 ) ) {
+                m_burst->stop();
+            }
+        }
+        else if ( (type == WS_EVT_DATA) && (client->id() == m_burstClient) ) {
+            char text[12];
+            size_t length = std::min( len, sizeof(text) - 1 );
+            memcpy( text, data, length );
+            text[length] = 0;
+            size_t buffers = strtoul( text, NULL, 10 );
+            if ( !m_burst->start( buffers ) ) {
+                TRACE( "Burst of %u buffers not started", buffers );
+            }
+        }
+    });
+    m_ws->m_web.addHandler( m_burstSocket );
+}
+
+
+bool Server::sendBurst() {
+    meter::Burst::Queue& queue = m_burst->queue();
+    while( !queue.empty() ) {
+        AsyncWebSocketClient* client = m_burstSocket->client( m_burstClient );
+        if ( client == NULL ) {
+            queue.pop();
+            continue;
+        }
+        if ( !client->canSend() ) {
+            return false;
+        }
+        const meter::Burst::Packet& packet = queue.front();
+        client->binary( reinterpret_cast<const char*>(&packet), sizeof(packet) );
+        queue.pop();
+    }
+    return true;
+}
+
+
+inline void transfer( const meter::SampleBasedMeter::Measures::Values& values, void* buffer ) {
+    memcpy( buffer, values.data(), values.size() * sizeof(int16_t) );
 }
 
 
-void Server::send( uint64_t time, const std::pair<float, float>& scaleFactors,
-                    const meter::SampleBasedMeter::Measures& samples ) {
+void Server::send( const meter::SampleBasedMeter::Measures& samples ) {
     if ( (m_sendBufferPos==NULL) && 
         ((m_ws->count() == 0) || !m_ws->availableForWrite()) ) {
     //    TRACE( "Samples has been discarded" );
@@ -64,14 +363,25 @@ void Server::send( uint64_t time, const std::pair<float, float>& scaleFactors,
         m_sendBufferEnd = m_sendBufferPos + PacketSentSize;
     }
 
+    uint64_t time = samples.time();
     memcpy( m_sendBufferPos, &time, sizeof(time) );
     m_sendBufferPos += sizeof(time);
 
-    memcpy( m_sendBufferPos, &scaleFactors, sizeof(scaleFactors) );
-    m_sendBufferPos += sizeof(scaleFactors);
+    const std::pair<float, float>& scaleFactors = samples.scaleFactors();
+    memcpy( m_sendBufferPos, &scaleFactors.first, sizeof(float) );
+    m_sendBufferPos += sizeof(float);
+    memcpy( m_sendBufferPos, &scaleFactors.second, sizeof(float) );
+    m_sendBufferPos += sizeof(float);
+
+    uint32_t quality = samples.quality();
+    memcpy( m_sendBufferPos, &quality, sizeof(quality) );
+    m_sendBufferPos += sizeof(quality);
 
-    transfer( samples, m_sendBufferPos );
-    m_sendBufferPos += EncodedSamplesSize;
+    // Voltages block followed by currents block
+    transfer( samples.voltage(), m_sendBufferPos );
+    m_sendBufferPos += EncodedSamplesSize / 2;
+    transfer( samples.current(), m_sendBufferPos );
+    m_sendBufferPos += EncodedSamplesSize / 2;
     
     if ( m_sendBufferPos == m_sendBufferEnd ) {
         m_ws->send( m_sendBuffer );
@@ -0,0 +1,31 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Host replacement of the parts of Arduino.h used by the platform independent headers
+// (util/trace.h). Serial writes to stdout.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <string>
+#include <algorithm>
+
+class __FlashStringHelper;
+#define F(x) (reinterpret_cast<const __FlashStringHelper*>(x))
+
+class HardwareSerial {
+public:
+    int printf( const char* format, ... ) __attribute__ ((format (printf, 2, 3))) {
+        va_list args;
+        va_start( args, format );
+        int ret = vprintf( format, args );
+        va_end( args );
+        return ret;
+    }
+};
+
+static HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef NATIVE_ESP_TIMER_H
+#define NATIVE_ESP_TIMER_H
+
+// Host replacement of the ESP-IDF high resolution timer: us since the first call
+
+#include <stdint.h>
+#include <chrono>
+
+inline int64_t esp_timer_get_time() {
+    typedef std::chrono::steady_clock Clock;
+    static const Clock::time_point start = Clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - start ).count();
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef NATIVE_GFXFONT_H
+#define NATIVE_GFXFONT_H
+
+// Host replacement of the font structures of the Adafruit GFX library
+
+#include <stdint.h>
+
+typedef struct {
+    uint16_t bitmapOffset;      // Of the glyph in GFXfont::bitmap
+    uint8_t width;
+    uint8_t height;
+    uint8_t xAdvance;
+    int8_t xOffset;             // From the cursor to the upper left corner
+    int8_t yOffset;
+} GFXglyph;
+
+typedef struct {
+    uint8_t* bitmap;
+    GFXglyph* glyph;
+    uint16_t first;
+    uint16_t last;
+    uint8_t yAdvance;
+} GFXfont;
+
+#endif
@@ -0,0 +1,183 @@
+#include "meter/adcmodel.h"
+#include <unity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+using meter::SweepPoint;
+using meter::DacSubsteps;
+using meter::_::AdcSegment;
+using meter::_::AdcSegments;
+using meter::_::AdcSegmentSize;
+
+static const int16_t MaxNoise = 3;
+
+
+void setUp() {}
+void tearDown() {}
+
+
+// ADC reading of a DAC code: saturated at both ends, not linear and noisy
+static uint16_t simulatedReading( uint16_t code ) {
+    double value = -250.0 + 14.0 * code + 0.025 * code * code + (rand() % (2 * MaxNoise + 1)) - MaxNoise;
+    return std::max( 0.0, std::min( 4095.0, value ) );
+}
+
+// Readings of the DAC codes step apart, as the coarse DAC sweep
+static std::vector<SweepPoint> sweep( uint8_t step ) {
+    std::vector<SweepPoint> ret;
+    for( unsigned code = 0; code <= 255; code += step ) {
+        SweepPoint point = { uint16_t(code * DacSubsteps), simulatedReading( code ) };
+        ret.push_back( point );
+    }
+    return ret;
+}
+
+// Reference inversion: the first DAC substep where the interpolated sweep reaches each
+// knot, searching all of them. The ends are where the ADC saturates
+static std::vector<uint16_t> bruteForceKnots( std::vector<SweepPoint> points ) {
+    for( size_t i = 1; i < points.size(); ++i ) {
+        points[i].adc = std::max( points[i].adc, points[i-1].adc );
+    }
+    uint16_t lowest = points.front().adc;
+    uint16_t highest = points.back().adc;
+    uint16_t dacFirst = 0;
+    uint16_t dacLast = points.back().dac;
+    for( const SweepPoint& point : points ) {
+        if ( point.adc == lowest ) {
+            dacFirst = point.dac;
+        }
+        if ( (point.adc == highest) && (point.dac < dacLast) ) {
+            dacLast = point.dac;
+        }
+    }
+
+    std::vector<uint16_t> ret( AdcSegments + 1, dacLast );
+    for( size_t k = 0; k <= AdcSegments; ++k ) {
+        double adc = k * AdcSegmentSize;
+        for( uint16_t dac = dacFirst; dac <= dacLast; ++dac ) {
+            size_t p = 1;
+            while( points[p].dac < dac ) {
+                ++p;
+            }
+            const SweepPoint& before = points[p-1];
+            const SweepPoint& after = points[p];
+            double interpolated = before.adc +
+                    double(after.adc - before.adc) * (dac - before.dac) / (after.dac - before.dac);
+            if ( interpolated >= adc ) {
+                ret[k] = dac;
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+// The model rounds the crossing of each knot, the reference takes the next substep
+static void checkAgainstBruteForce( const std::vector<SweepPoint>& points ) {
+    std::vector<SweepPoint> fitted( points );
+    std::vector<uint16_t> knots( AdcSegments + 1 );
+    meter::fitDacModel( fitted.data(), fitted.size(), knots.data() );
+    std::vector<uint16_t> expected = bruteForceKnots( points );
+
+    for( size_t k = 0; k <= AdcSegments; ++k ) {
+        char message[64];
+        snprintf( message, sizeof(message), "Knot %u", unsigned(k) );
+        TEST_ASSERT_INT_WITHIN_MESSAGE( 1, expected[k], knots[k], message );
+        TEST_ASSERT_TRUE_MESSAGE( knots[k] <= expected[k], message );
+    }
+}
+
+
+void test_fit_full_sweep() {
+    for( int i = 0; i < 20; ++i ) {
+        checkAgainstBruteForce( sweep( 1 ) );
+    }
+}
+
+void test_fit_coarse_sweep() {
+    for( int i = 0; i < 20; ++i ) {
+        checkAgainstBruteForce( sweep( 16 ) );
+    }
+}
+
+void test_fit_linear_sweep_is_exact() {
+    std::vector<SweepPoint> points;
+    for( unsigned code = 0; code <= 255; code += 5 ) {
+        SweepPoint point = { uint16_t(code * DacSubsteps), uint16_t(code * 16) };
+        points.push_back( point );
+    }
+    std::vector<uint16_t> knots( AdcSegments + 1 );
+    meter::fitDacModel( points.data(), points.size(), knots.data() );
+    for( size_t k = 0; k < AdcSegments; ++k ) {
+        TEST_ASSERT_EQUAL_UINT16( k * AdcSegmentSize, knots[k] );
+    }
+    TEST_ASSERT_EQUAL_UINT16( 255 * DacSubsteps, knots[AdcSegments] );
+}
+
+void test_fit_is_non_decreasing() {
+    std::vector<SweepPoint> points = sweep( 1 );
+    std::vector<uint16_t> knots( AdcSegments + 1 );
+    meter::fitDacModel( points.data(), points.size(), knots.data() );
+    for( size_t k = 1; k <= AdcSegments; ++k ) {
+        TEST_ASSERT_TRUE( knots[k] >= knots[k-1] );
+    }
+}
+
+// The segments evaluated in the sampling loop give the same values as the knots
+void test_segments_match_knots() {
+    std::vector<SweepPoint> points = sweep( 1 );
+    std::vector<uint16_t> knots( AdcSegments + 1 );
+    meter::fitDacModel( points.data(), points.size(), knots.data() );
+    AdcSegment segments[AdcSegments];
+    meter::knotsToSegments( knots.data(), segments );
+    for( uint16_t adc = 0; adc < 4096; ++adc ) {
+        TEST_ASSERT_EQUAL_UINT16( meter::evaluateKnots( knots.data(), adc ),
+                                  meter::_::evaluateSegments( segments, adc ) );
+    }
+}
+
+
+// Time of fitting the model to a full sweep against the brute force inversion. On the
+// device calibration time is dominated by the ADC readings of the sweep
+void benchmark_fit() {
+    static const int Iterations = 2000;
+    std::vector<SweepPoint> points = sweep( 1 );
+    std::vector<SweepPoint> fitted;
+    std::vector<uint16_t> knots( AdcSegments + 1 );
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for( int i = 0; i < Iterations; ++i ) {
+        fitted = points;
+        meter::fitDacModel( fitted.data(), fitted.size(), knots.data() );
+        __asm__ __volatile__( "" : : "r"(knots.data()) : "memory" );
+    }
+    Clock::time_point fitTime = Clock::now();
+    std::vector<uint16_t> expected = bruteForceKnots( points );
+    Clock::time_point bruteForceTime = Clock::now();
+
+    typedef std::chrono::duration<double, std::micro> Us;
+    char message[160];
+    snprintf( message, sizeof(message),
+            "Sweep of %u points: fit %.2f us, brute force inversion %.0f us",
+            unsigned(points.size()), Us(fitTime - start).count() / Iterations,
+            Us(bruteForceTime - fitTime).count() );
+    TEST_MESSAGE( message );
+    TEST_ASSERT_INT_WITHIN( 1, expected[AdcSegments/2], knots[AdcSegments/2] );
+}
+
+
+int main( int, char** ) {
+    srand( 1 );
+    UNITY_BEGIN();
+    RUN_TEST( test_fit_full_sweep );
+    RUN_TEST( test_fit_coarse_sweep );
+    RUN_TEST( test_fit_linear_sweep_is_exact );
+    RUN_TEST( test_fit_is_non_decreasing );
+    RUN_TEST( test_segments_match_knots );
+    RUN_TEST( benchmark_fit );
+    return UNITY_END();
+}
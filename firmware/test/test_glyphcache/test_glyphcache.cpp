@@ -0,0 +1,228 @@
+#include "io/glyphcache.h"
+#include <pgmspace.h>
+#include "font/dialog8pt.h"
+#include "font/dialog13pt.h"
+#include "font/dialog14pt.h"
+#include "font/dialog17pt.h"
+#include <unity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+
+// As the display of the wattmeter
+static const int16_t Width = 128;
+static const int16_t Height = 64;
+static const int16_t Pages = Height / 8;
+
+// As SSD1306
+static const uint16_t Black = 0;
+static const uint16_t White = 1;
+static const uint16_t Inverse = 2;
+
+static const GFXfont* Fonts[] = { &Dialog_plain_8, &Dialog_plain_13, &Dialog_plain_14, &Dialog_plain_17 };
+
+typedef std::vector<uint8_t> Frame;
+
+
+void setUp() {}
+void tearDown() {}
+
+
+// As SSD1306::setBits
+static void setBits( uint8_t& data, uint8_t mask, uint16_t color ) {
+    switch (color) {
+    case White:
+        data |= mask;
+        break;
+    case Black:
+        data &= ~mask;
+        break;
+    case Inverse:
+        data ^= mask;
+        break;
+    }
+}
+
+// Adafruit_GFX::drawChar with a GFX font, without scaling: the bitmap of the glyph is
+// drawn pixel by pixel, clipped as SSD1306::drawPixel
+static void drawChar( Frame& frame, const GFXfont* font, int16_t x, int16_t y, uint8_t c, uint16_t color ) {
+    const GFXglyph* glyph = &font->glyph[c - font->first];
+    const uint8_t* bitmap = font->bitmap + glyph->bitmapOffset;
+    uint8_t bits = 0;
+    uint8_t bit = 0;
+    for( int16_t yy = 0; yy < glyph->height; ++yy ) {
+        for( int16_t xx = 0; xx < glyph->width; ++xx ) {
+            if ( !(bit++ & 7) ) {
+                bits = *bitmap++;
+            }
+            if ( bits & 0x80 ) {
+                int16_t px = x + glyph->xOffset + xx;
+                int16_t py = y + glyph->yOffset + yy;
+                if ( (px >= 0) && (px < Width) && (py >= 0) && (py < Height) ) {
+                    setBits( frame[px + (py / 8) * Width], 1 << (py & 7), color );
+                }
+            }
+            bits <<= 1;
+        }
+    }
+}
+
+// As SSD1306::drawGlyph
+static void drawGlyph( Frame& frame, const GlyphCache& cache, int16_t x, int16_t y, uint8_t c, uint16_t color ) {
+    GlyphCache::draw( cache.glyph(c), frame.data(), Width, Pages, x, y,
+                      [color]( uint8_t& data, uint8_t mask ) { setBits( data, mask, color ); } );
+}
+
+static Frame randomFrame() {
+    Frame ret( Width * Pages );
+    for( uint8_t& data : ret ) {
+        data = rand();
+    }
+    return ret;
+}
+
+
+// Every glyph of the font at positions that cross each edge of the display and each
+// row of a page, on a random frame, in every color
+static void checkFont( const GFXfont* font ) {
+    GlyphCache cache( font );
+    TEST_ASSERT_TRUE( cache.valid() );
+    const Frame background = randomFrame();
+
+    const uint16_t colors[] = { White, Black, Inverse };
+    for( uint16_t color : colors ) {
+        for( uint16_t c = font->first; c <= font->last; ++c ) {
+            for( int16_t y = -8; y < Height + 24; y += 3 ) {
+                for( int16_t x = -20; x < Width + 4; x += 5 ) {
+                    Frame expected = background;
+                    Frame result = background;
+                    drawChar( expected, font, x, y, c, color );
+                    drawGlyph( result, cache, x, y, c, color );
+                    if ( memcmp( expected.data(), result.data(), expected.size() ) != 0 ) {
+                        char message[80];
+                        snprintf( message, sizeof(message), "Glyph '%c' at %d, %d, color %u",
+                                  c, x, y, color );
+                        TEST_ASSERT_EQUAL_UINT8_ARRAY_MESSAGE( expected.data(), result.data(),
+                                                               expected.size(), message );
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+void test_dialog8() {
+    checkFont( &Dialog_plain_8 );
+}
+
+void test_dialog13() {
+    checkFont( &Dialog_plain_13 );
+}
+
+void test_dialog14() {
+    checkFont( &Dialog_plain_14 );
+}
+
+void test_dialog17() {
+    checkFont( &Dialog_plain_17 );
+}
+
+// Glyphs taller than MaxGlyphHeight are left to Adafruit_GFX
+void test_tall_glyph_is_not_cached() {
+    uint8_t bitmap[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+    GFXglyph glyphs[] = { { 0, 1, GlyphCache::MaxGlyphHeight + 1, 2, 0, -25 } };
+    GFXfont font = { bitmap, glyphs, 'A', 'A', 26 };
+    GlyphCache cache( &font );
+    TEST_ASSERT_FALSE( cache.valid() );
+}
+
+
+// Time of drawing the fields of the wattmeter display, as Display, pixel by pixel and
+// from the glyph caches. On the device drawChar also pays a virtual drawPixel per pixel
+void benchmark_frame() {
+    static const int Iterations = 20000;
+    static const struct {
+        const GFXfont* font;
+        int16_t x;
+        int16_t y;
+        const char* text;
+    } fields[] = {
+        { &Dialog_plain_17,  0, 15, "50.01 Hz" },
+        { &Dialog_plain_8,  96,  8, "44 kHz" },
+        { &Dialog_plain_13,  0, 31, "230.41 V" },
+        { &Dialog_plain_13,  0, 47, "1.23 A" },
+        { &Dialog_plain_13,  0, 63, "283.40 W" },
+        { &Dialog_plain_8,  80, 34, "290.12 VA" },
+        { &Dialog_plain_8,  80, 47, "58.27 var" },
+        { &Dialog_plain_8,  80, 59, "0.98" }
+    };
+    std::vector<GlyphCache> caches;
+    for( const GFXfont* font : Fonts ) {
+        caches.emplace_back( font );
+    }
+    Frame expected( Width * Pages );
+    Frame result( Width * Pages );
+    size_t glyphs = 0;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for( int n = 0; n < Iterations; ++n ) {
+        std::fill( expected.begin(), expected.end(), 0 );
+        for( const auto& field : fields ) {
+            int16_t x = field.x;
+            for( const char* c = field.text; *c != 0; ++c ) {
+                drawChar( expected, field.font, x, field.y, *c, White );
+                x += field.font->glyph[*c - field.font->first].xAdvance;
+            }
+        }
+        __asm__ __volatile__( "" : : "r"(expected.data()) : "memory" );
+    }
+    Clock::time_point drawn = Clock::now();
+    for( int n = 0; n < Iterations; ++n ) {
+        std::fill( result.begin(), result.end(), 0 );
+        glyphs = 0;
+        for( const auto& field : fields ) {
+            const GlyphCache* cache = NULL;
+            for( const GlyphCache& fontCache : caches ) {
+                if ( fontCache.font() == field.font ) {
+                    cache = &fontCache;
+                }
+            }
+            int16_t x = field.x;
+            for( const char* c = field.text; *c != 0; ++c, ++glyphs ) {
+                drawGlyph( result, *cache, x, field.y, *c, White );
+                x += cache->glyph(*c).xAdvance;
+            }
+        }
+        __asm__ __volatile__( "" : : "r"(result.data()) : "memory" );
+    }
+    Clock::time_point cacheDrawn = Clock::now();
+
+    typedef std::chrono::duration<double, std::micro> Us;
+    char message[160];
+    snprintf( message, sizeof(message),
+            "Frame of %u glyphs: GFX drawChar %.2f us, glyph cache %.2f us",
+            unsigned(glyphs),
+            Us(drawn - start).count() / Iterations,
+            Us(cacheDrawn - drawn).count() / Iterations );
+    TEST_MESSAGE( message );
+    TEST_ASSERT_EQUAL_UINT8_ARRAY( expected.data(), result.data(), expected.size() );
+}
+
+
+int main( int, char** ) {
+    srand( 1 );
+    UNITY_BEGIN();
+    RUN_TEST( test_dialog8 );
+    RUN_TEST( test_dialog13 );
+    RUN_TEST( test_dialog14 );
+    RUN_TEST( test_dialog17 );
+    RUN_TEST( test_tall_glyph_is_not_cached );
+    RUN_TEST( benchmark_frame );
+    return UNITY_END();
+}
@@ -0,0 +1,174 @@
+#include "util/pack12.h"
+#include <unity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+
+// As adc::BufferSize, that can't be included on the host
+static const size_t BufferSize = 1024;
+
+static const uint8_t Channels[] = { 0, 3 };
+
+
+void setUp() {}
+void tearDown() {}
+
+
+// Raw ADC codes tagged with the channels of the sequence
+static std::vector<uint16_t> rawCodes( size_t size, const uint8_t* channels, size_t channelsSize ) {
+    std::vector<uint16_t> ret( size );
+    for( size_t i = 0; i < size; ++i ) {
+        ret[i] = (channels[i % channelsSize] << 12) | (rand() & 0xFFF);
+    }
+    return ret;
+}
+
+static std::vector<uint16_t> roundTrip( const std::vector<uint16_t>& in,
+                                        const uint8_t* channels, size_t channelsSize ) {
+    std::vector<uint8_t> packed( pack12::packedSize( in.size() ) );
+    size_t written = pack12::pack( in, packed );
+    TEST_ASSERT_EQUAL( packed.size(), written );
+
+    std::vector<uint16_t> out( in.size() );
+    pack12::unpack( packed, out, nonstd::span<const uint8_t>( channels, channelsSize ) );
+    return out;
+}
+
+
+void test_packed_size() {
+    TEST_ASSERT_EQUAL( 0, pack12::packedSize(0) );
+    TEST_ASSERT_EQUAL( 2, pack12::packedSize(1) );
+    TEST_ASSERT_EQUAL( 3, pack12::packedSize(2) );
+    TEST_ASSERT_EQUAL( 5, pack12::packedSize(3) );
+    TEST_ASSERT_EQUAL( BufferSize * 3 / 4 * 2, pack12::packedSize(BufferSize) );
+}
+
+void test_layout() {
+    const uint16_t in[] = { 0x0ABC, 0x3DEF };
+    uint8_t packed[3];
+    pack12::pack( in, packed );
+    TEST_ASSERT_EQUAL_UINT8( 0xBC, packed[0] );
+    TEST_ASSERT_EQUAL_UINT8( 0xDA, packed[1] );
+    TEST_ASSERT_EQUAL_UINT8( 0xEF, packed[2] );
+}
+
+void test_round_trip() {
+    std::vector<uint16_t> in = rawCodes( BufferSize, Channels, sizeof(Channels) );
+    std::vector<uint16_t> out = roundTrip( in, Channels, sizeof(Channels) );
+    TEST_ASSERT_EQUAL_UINT16_ARRAY( in.data(), out.data(), in.size() );
+}
+
+void test_round_trip_three_channels() {
+    const uint8_t channels[] = { 0, 3, 5 };
+    std::vector<uint16_t> in = rawCodes( BufferSize, channels, sizeof(channels) );
+    std::vector<uint16_t> out = roundTrip( in, channels, sizeof(channels) );
+    TEST_ASSERT_EQUAL_UINT16_ARRAY( in.data(), out.data(), in.size() );
+}
+
+void test_round_trip_odd_lengths() {
+    for( size_t size = 1; size < 16; size += 2 ) {
+        std::vector<uint16_t> in = rawCodes( size, Channels, sizeof(Channels) );
+        std::vector<uint16_t> out = roundTrip( in, Channels, sizeof(Channels) );
+        TEST_ASSERT_EQUAL_UINT16_ARRAY( in.data(), out.data(), in.size() );
+    }
+}
+
+void test_odd_last_sample_doesnt_write_past_its_bytes() {
+    const uint16_t in[] = { 0x0123, 0x3456, 0x0FFF };
+    uint8_t packed[6];
+    memset( packed, 0xAA, sizeof(packed) );
+    TEST_ASSERT_EQUAL( 5, pack12::pack( in, nonstd::span<uint8_t>( packed, 5 ) ) );
+    TEST_ASSERT_EQUAL_UINT8( 0xFF, packed[3] );
+    TEST_ASSERT_EQUAL_UINT8( 0x0F, packed[4] );
+    TEST_ASSERT_EQUAL_UINT8( 0xAA, packed[5] );
+}
+
+void test_channels_are_restored_from_the_sequence() {
+    const uint16_t in[] = { 0x5123, 0x0456 };
+    uint16_t out[2];
+    uint8_t packed[3];
+    pack12::pack( in, packed );
+    pack12::unpack( packed, out, Channels );
+    TEST_ASSERT_EQUAL_UINT16( 0x0123, out[0] );
+    TEST_ASSERT_EQUAL_UINT16( 0x3456, out[1] );
+}
+
+void test_sequence_of_three_channels() {
+    const uint8_t channels[] = { 3, 0, 5 };
+    std::vector<uint16_t> in = rawCodes( BufferSize, channels, sizeof(channels) );
+    uint8_t sequence[4] = { 0xAA, 0xAA, 0xAA, 0xAA };
+    pack12::sequence( in, nonstd::span<uint8_t>( sequence, 3 ) );
+    TEST_ASSERT_EQUAL_UINT8_ARRAY( channels, sequence, 3 );
+    TEST_ASSERT_EQUAL_UINT8( 0xAA, sequence[3] );
+    TEST_ASSERT_EQUAL( 0, pack12::sequenceErrors( in, nonstd::span<const uint8_t>( sequence, 3 ) ) );
+}
+
+void test_sequence_errors() {
+    std::vector<uint16_t> in = rawCodes( BufferSize, Channels, sizeof(Channels) );
+    TEST_ASSERT_EQUAL( 0, pack12::sequenceErrors( in, Channels ) );
+
+    // A lost sample shifts the sequence: every following value is out of place
+    std::vector<uint16_t> shifted( in.begin() + 1, in.end() );
+    TEST_ASSERT_EQUAL( shifted.size(), pack12::sequenceErrors( shifted, Channels ) );
+
+    in[10] = (6 << 12) | (in[10] & 0xFFF);
+    in[11] = (0 << 12) | (in[11] & 0xFFF);
+    TEST_ASSERT_EQUAL( 2, pack12::sequenceErrors( in, Channels ) );
+}
+
+void test_sequence_errors_empty() {
+    TEST_ASSERT_EQUAL( 0, pack12::sequenceErrors( nonstd::span<const uint16_t>(), Channels ) );
+}
+
+
+// Time of packing and unpacking an ADC buffer
+void benchmark_pack12() {
+    static const int Iterations = 20000;
+    std::vector<uint16_t> in = rawCodes( BufferSize, Channels, sizeof(Channels) );
+    std::vector<uint16_t> out( BufferSize );
+    std::vector<uint8_t> packed( pack12::packedSize( BufferSize ) );
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for( int i = 0; i < Iterations; ++i ) {
+        pack12::pack( in, packed );
+        __asm__ __volatile__( "" : : "r"(packed.data()) : "memory" );
+    }
+    Clock::time_point packedTime = Clock::now();
+    for( int i = 0; i < Iterations; ++i ) {
+        pack12::unpack( packed, out, Channels );
+        __asm__ __volatile__( "" : : "r"(out.data()) : "memory" );
+    }
+    Clock::time_point unpacked = Clock::now();
+
+    typedef std::chrono::duration<double, std::micro> Us;
+    char message[160];
+    snprintf( message, sizeof(message),
+            "Buffer of %u samples: %u bytes packed (%u raw). Pack %.2f us, unpack %.2f us",
+            unsigned(BufferSize), unsigned(packed.size()), unsigned(BufferSize * sizeof(uint16_t)),
+            Us(packedTime - start).count() / Iterations,
+            Us(unpacked - packedTime).count() / Iterations );
+    TEST_MESSAGE( message );
+    TEST_ASSERT_EQUAL_UINT16_ARRAY( in.data(), out.data(), in.size() );
+}
+
+
+int main( int, char** ) {
+    UNITY_BEGIN();
+    RUN_TEST( test_packed_size );
+    RUN_TEST( test_layout );
+    RUN_TEST( test_round_trip );
+    RUN_TEST( test_round_trip_three_channels );
+    RUN_TEST( test_round_trip_odd_lengths );
+    RUN_TEST( test_odd_last_sample_doesnt_write_past_its_bytes );
+    RUN_TEST( test_channels_are_restored_from_the_sequence );
+    RUN_TEST( test_sequence_of_three_channels );
+    RUN_TEST( test_sequence_errors );
+    RUN_TEST( test_sequence_errors_empty );
+    RUN_TEST( benchmark_pack12 );
+    return UNITY_END();
+}
@@ -0,0 +1,167 @@
+#include "meter/ranges.h"
+#include <unity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+
+
+// util/trace.cpp isn't built for the host
+namespace trace {
+
+std::string format( const char* format, ... ) {
+    char buffer[128];
+    va_list args;
+    va_start( args, format );
+    vsnprintf( buffer, sizeof(buffer), format, args );
+    va_end( args );
+    return buffer;
+}
+
+void log( const char*, const char*, int, const char* ) {}
+
+}
+
+
+// As adc::GroupedSamplesSize, that can't be included on the host
+static const size_t BlockSize = 64;
+
+typedef meter::Ranges<3> Ranges;
+
+
+void setUp() {}
+void tearDown() {}
+
+
+static void setUpRanges( Ranges& ranges, bool autoRange, int16_t zeroDrift ) {
+    const uint16_t zeros[] = { 4500, 4600, 4700 };
+    const float scaleFactors[] = { 1.0, 0.5, 0.25 };
+    ranges.setZeros( zeros );
+    ranges.setScaleFactors( scaleFactors );
+    ranges.setAutoRange( autoRange );
+    ranges.setZeroDrift( zeroDrift );
+    ranges.setActive( 1 );
+}
+
+// Values in tenths of mV around the zero, with an amplitude that can overflow the limits
+static std::vector<uint16_t> block( uint16_t amplitude ) {
+    std::vector<uint16_t> ret( BlockSize );
+    for( size_t i = 0; i < BlockSize; ++i ) {
+        ret[i] = 4600 - amplitude + rand() % (2 * amplitude + 1);
+    }
+    return ret;
+}
+
+// Processes the same blocks value by value and with processBlock. Results, overflows and
+// the best range from the peaks must be the same
+static void checkEquivalence( bool autoRange, int16_t zeroDrift ) {
+    Ranges byValue;
+    Ranges byBlock;
+    setUpRanges( byValue, autoRange, zeroDrift );
+    setUpRanges( byBlock, autoRange, zeroDrift );
+
+    const uint16_t amplitudes[] = { 100, 1500, 3000, 4000, 5000, 6000 };
+    for( int n = 0; n < 200; ++n ) {
+        std::vector<uint16_t> values = block( amplitudes[n % 6] );
+        std::vector<int16_t> expected( BlockSize );
+        std::vector<int16_t> result( BlockSize );
+        for( size_t i = 0; i < BlockSize; ++i ) {
+            expected[i] = byValue.process( values[i] );
+        }
+        byBlock.processBlock( values, result );
+        byValue.endBlock();
+        byBlock.endBlock();
+
+        TEST_ASSERT_EQUAL_INT16_ARRAY( expected.data(), result.data(), BlockSize );
+        TEST_ASSERT_EQUAL( byValue.takeOverflow(), byBlock.takeOverflow() );
+        TEST_ASSERT_EQUAL( byValue.best(), byBlock.best() );
+    }
+}
+
+
+void test_process_block_equivalence() {
+    checkEquivalence( false, 0 );
+}
+
+void test_process_block_equivalence_auto_range() {
+    checkEquivalence( true, 0 );
+}
+
+void test_process_block_equivalence_zero_drift() {
+    checkEquivalence( true, -37 );
+    checkEquivalence( true, 52 );
+}
+
+void test_process_block_empty() {
+    Ranges ranges;
+    setUpRanges( ranges, true, 0 );
+    ranges.processBlock( nonstd::span<const uint16_t>(), nonstd::span<int16_t>() );
+    TEST_ASSERT_FALSE( ranges.takeOverflow() );
+}
+
+void test_process_block_overflow() {
+    Ranges ranges;
+    setUpRanges( ranges, false, 0 );
+    std::vector<uint16_t> values( BlockSize, 4600 );
+    std::vector<int16_t> result( BlockSize );
+    ranges.processBlock( values, result );
+    TEST_ASSERT_FALSE( ranges.takeOverflow() );
+
+    values[BlockSize / 2] = meter::Range::HIGHEST_INPUT_VALUE + 1;
+    ranges.processBlock( values, result );
+    TEST_ASSERT_TRUE( ranges.takeOverflow() );
+    TEST_ASSERT_FALSE( ranges.takeOverflow() );
+
+    values[BlockSize / 2] = meter::Range::LOWEST_INPUT_VALUE - 1;
+    ranges.processBlock( values, result );
+    TEST_ASSERT_TRUE( ranges.takeOverflow() );
+}
+
+
+// Time of converting a block of grouped values with process() and with processBlock
+void benchmark_process_block() {
+    static const int Iterations = 200000;
+    Ranges ranges;
+    setUpRanges( ranges, true, 0 );
+    std::vector<uint16_t> values = block( 3000 );
+    std::vector<int16_t> result( BlockSize );
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    for( int n = 0; n < Iterations; ++n ) {
+        for( size_t i = 0; i < BlockSize; ++i ) {
+            result[i] = ranges.process( values[i] );
+        }
+        __asm__ __volatile__( "" : : "r"(result.data()) : "memory" );
+    }
+    Clock::time_point processed = Clock::now();
+    for( int n = 0; n < Iterations; ++n ) {
+        ranges.processBlock( values, result );
+        __asm__ __volatile__( "" : : "r"(result.data()) : "memory" );
+    }
+    Clock::time_point blockProcessed = Clock::now();
+
+    typedef std::chrono::duration<double, std::nano> Ns;
+    char message[160];
+    snprintf( message, sizeof(message),
+            "Block of %u values: process() %.1f ns, processBlock %.1f ns",
+            unsigned(BlockSize),
+            Ns(processed - start).count() / Iterations,
+            Ns(blockProcessed - processed).count() / Iterations );
+    TEST_MESSAGE( message );
+    TEST_ASSERT_TRUE( ranges.takeOverflow() == false );
+}
+
+
+int main( int, char** ) {
+    srand( 1 );
+    UNITY_BEGIN();
+    RUN_TEST( test_process_block_equivalence );
+    RUN_TEST( test_process_block_equivalence_auto_range );
+    RUN_TEST( test_process_block_equivalence_zero_drift );
+    RUN_TEST( test_process_block_empty );
+    RUN_TEST( test_process_block_overflow );
+    RUN_TEST( benchmark_process_block );
+    return UNITY_END();
+}
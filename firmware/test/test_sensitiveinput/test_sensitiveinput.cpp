@@ -0,0 +1,102 @@
+#include "meter/sensitiveinput.h"
+#include <unity.h>
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+
+
+// util/trace.cpp isn't built for the host
+namespace trace {
+
+std::string format( const char* format, ... ) {
+    char buffer[128];
+    va_list args;
+    va_start( args, format );
+    vsnprintf( buffer, sizeof(buffer), format, args );
+    va_end( args );
+    return buffer;
+}
+
+void log( const char*, const char*, int, const char* ) {}
+
+}
+
+
+using meter::SensitiveInput;
+using meter::Range;
+
+static const uint16_t Zero = 4600;
+
+
+void setUp() {}
+void tearDown() {}
+
+
+static SensitiveInput sensitiveInput( float gain ) {
+    SensitiveInput ret;
+    ret.setGain( gain );
+    ret.setZero( Zero );
+    return ret;
+}
+
+
+void test_output_gain_keeps_limits_in_int16() {
+    SensitiveInput input = sensitiveInput( 10.0 );
+    TEST_ASSERT_TRUE( input.outputGain() < 10.0 );
+    TEST_ASSERT_TRUE( input.outputGain() * Range::HIGHEST_INPUT_VALUE <= 32767.0 );
+
+    input.setGain( 2.0 );
+    TEST_ASSERT_EQUAL_FLOAT( 2.0, input.outputGain() );
+}
+
+// Merged values are the nearest output unit, not truncated towards zero
+void test_merge_rounds() {
+    SensitiveInput input = sensitiveInput( 10.0 );
+    const float sensitiveScale = input.outputGain() / input.gain();
+    for( int offset = -200; offset <= 200; ++offset ) {
+        const uint16_t values[] = { uint16_t(Zero + offset) };
+        int16_t result[] = { 0 };
+        input.merge( values, 0, result );
+        long expected = lroundf( offset * sensitiveScale );
+        TEST_ASSERT_EQUAL( expected, result[0] );
+    }
+}
+
+void test_merge_keeps_main_values_when_sensitive_clips() {
+    SensitiveInput input = sensitiveInput( 10.0 );
+    const uint16_t values[] = { Range::HIGHEST_INPUT_VALUE + 1, Range::LOWEST_INPUT_VALUE - 1 };
+    int16_t result[] = { 1000, -1000 };
+    input.merge( values, 0, result );
+    TEST_ASSERT_EQUAL( lroundf( 1000 * input.outputGain() ), result[0] );
+    TEST_ASSERT_EQUAL( lroundf( -1000 * input.outputGain() ), result[1] );
+}
+
+void test_merge_applies_zero_drift() {
+    SensitiveInput input = sensitiveInput( 2.0 );
+    const uint16_t values[] = { Zero + 30 };
+    int16_t result[] = { 0 };
+    input.merge( values, 10, result );
+    TEST_ASSERT_EQUAL( 20, result[0] );
+}
+
+void test_scale_saturates() {
+    SensitiveInput input = sensitiveInput( 10.0 );
+    std::vector<int16_t> values = { 32000, -32000, 100, -100 };
+    input.scale( values );
+    TEST_ASSERT_EQUAL( 32767, values[0] );
+    TEST_ASSERT_EQUAL( -32768, values[1] );
+    TEST_ASSERT_EQUAL( lroundf( 100 * input.outputGain() ), values[2] );
+    TEST_ASSERT_EQUAL( lroundf( -100 * input.outputGain() ), values[3] );
+}
+
+
+int main( int, char** ) {
+    UNITY_BEGIN();
+    RUN_TEST( test_output_gain_keeps_limits_in_int16 );
+    RUN_TEST( test_merge_rounds );
+    RUN_TEST( test_merge_keeps_main_values_when_sensitive_clips );
+    RUN_TEST( test_merge_applies_zero_drift );
+    RUN_TEST( test_scale_saturates );
+    return UNITY_END();
+}